@@ -8,9 +8,12 @@
 #include <dpmi/dbgutil.h>
 #include <untrapio.h>
 
+#include <opl3emu.h>
 #include "hdpmipt.h"
 
 #define HDPMIPT_SWITCH_STACK 1 //TODO: debug
+#define HDPMIPT_HANDLE_OPL_DIRECTLY 1 //388h/389h status reads and 388h index writes, same as QEMM real mode stub
+#define HDPMIPT_POST_OPL_WRITES 1 //389h data writes queued to OPL3EMU_PostRing, applied by emulation later
 #define HDPMIPT_STACKSIZE 16384
 
 typedef struct
@@ -26,10 +29,29 @@ static HDPMIPT_ENTRY HDPMIPT_Entry;
 #if HDPMIPT_SWITCH_STACK
 static uint32_t HDPMIPT_OldESP[2];
 static uint32_t HDPMIPT_NewStack[2];
+static volatile uint32_t HDPMIPT_TrapDepth; //nested traps in handler
 #endif
 
 static QEMM_IODT_LINK HDPMIPT_IODT_header;
 static QEMM_IODT_LINK* HDPMIPT_IODT_Link = &HDPMIPT_IODT_header;
+static QEMM_IOTRAP_HANDLER HDPMIPT_DispatchTable[QEMM_DISPATCH_PORTS];
+
+#define HDPMIPT_MAX_RANGES 16 //host traps
+#define HDPMIPT_MERGE_GAP 4 //max untrapped ports between two ranges to merge them into one host trap. they pass through
+#define HDPMIPT_MERGE_BLOCK 0x10 //gaps only merged inside one card's decode block (i.e. SB base+0~F)
+#define HDPMIPT_MERGE_MIN_PORT 0x100 //mainboard devices below (DMA, page regs, PIC): gap ports are real registers, merged only if adjacent
+
+typedef struct
+{
+    uint16_t start;
+    uint16_t end;
+    uint32_t handle;
+}HDPMIPT_RANGE;
+
+//host traps installed for all trap sets: merged from their ports, shared by them
+static HDPMIPT_RANGE HDPMIPT_Ranges[HDPMIPT_MAX_RANGES];
+static int HDPMIPT_RangeCount;
+static uint32_t HDPMIPT_PortMap[65536/32]; //temp for merging
 
 static uint16_t HDPMIPT_GetDS()
 {
@@ -53,31 +75,93 @@ static uint32_t __attribute__((noinline)) HDPMIPT_TrapHandler()
     QEMM_TrapFlags |= QEMM_TF_PM;
     //if(port >= 0 && port <= 0xF)
         //_LOG("Trapped PM: %s %x\n", out ? "out" : "in", port);
-    QEMM_IODT_LINK* link = HDPMIPT_IODT_header.next;
-    while(link)
+    QEMM_TRAPSTAT_MARK(tsc);
+    QEMM_IOTRAP_HANDLER handler = QEMM_FindHandler(&HDPMIPT_IODT_header, HDPMIPT_DispatchTable, port);
+    uint32_t result;
+    if(handler)
+        result = handler(port, value, out);
+    else if(out) //not emulated port in a merged range
     {
-        for(int i = 0; i < link->count; ++i)
-        {
-            //if(port>=0&&port<=0xF)
-            //    _LOG("port: %s %04x, %04x, %04x\n",out ? "out" : "in",port, link->iodt[i].port, value);
-            if(link->iodt[i].port == port)
-                return link->iodt[i].handler(port, value, out);
-        }
-        link = link->next;
+        HDPMIPT_UntrappedIO_Write((uint16_t)port, (uint8_t)value);
+        result = value;
     }
-    return value;
+    else
+        result = (value&~0xFFU) | HDPMIPT_UntrappedIO_Read((uint16_t)port);
+    QEMM_TRAPSTAT_ADD(tsc, port, out);
+    return result;
 }
 
 static void __attribute__((naked)) HDPMIPT_TrapHandlerWrapper()
 {
-    //switch to local stack from trapped client's stack
+    //edx=port, ecx=out, eax=value. AdLib drivers read status ~6 times per register write, skip stack switch and dispatch for them
+    #if HDPMIPT_HANDLE_OPL_DIRECTLY
+    asm(
+    "cmp $0x388, %%edx \n\t"
+    "je 1f \n\t"
+    "cmp $0x389, %%edx \n\t"
+    "jne 3f \n\t"
+    "test %%ecx, %%ecx \n\t"
+    #if HDPMIPT_POST_OPL_WRITES
+    "jnz 4f \n\t"
+    #else
+    "jnz 3f \n\t" //out 389h: data write, go emulation
+    #endif
+    "2: and $0xFFFFFF00, %%eax \n\t" //in 388h/389h
+    "or %0, %%al \n\t"
+    "lret \n\t"
+    "1: test %%ecx, %%ecx \n\t"
+    "jz 2b \n\t"
+    "movzbl %%al, %%ecx \n\t" //out 388h: latch index
+    "mov %%ecx, %1 \n\t"
+    "mov %3, %%ecx \n\t" //and the mirrored latch (OPL3EMU_IndexLatch), if any
+    "jecxz 6f \n\t"
+    "mov %%al, (%%ecx) \n\t"
+    "6: lret \n\t"
+    #if HDPMIPT_POST_OPL_WRITES
+    "4: cmpl $4, %1 \n\t" //timer reg: status changes, go emulation
+    "je 3f \n\t"
+    "push %%ebx \n\t"
+    "push %%ecx \n\t"
+    "push %%edx \n\t"
+    "movzwl %c2, %%ebx \n\t" //Head
+    "lea 1(%%ebx), %%ecx \n\t"
+    "and $0xFF, %%ecx \n\t" //OPL3EMU_POST_COUNT-1
+    "cmp %c2+2, %%cx \n\t" //Tail
+    "je 5f \n\t" //full: let emulation flush & write it
+    "lea %c2+4(,%%ebx,2), %%ebx \n\t" //Data
+    "mov %%al, (%%ebx) \n\t"
+    "movzbl %1, %%edx \n\t"
+    "mov %%dl, 1(%%ebx) \n\t"
+    "mov %%cx, %c2 \n\t" //publish after data written
+    "pop %%edx \n\t"
+    "pop %%ecx \n\t"
+    "pop %%ebx \n\t"
+    "lret \n\t"
+    "5: pop %%edx \n\t"
+    "pop %%ecx \n\t"
+    "pop %%ebx \n\t"
+    #endif
+    "3: \n\t"
+    :
+    :"m"(OPL3EMU_Status),"m"(OPL3EMU_IndexReg[0]),"i"(&OPL3EMU_PostRing),"m"(OPL3EMU_IndexLatch) //absolute address: no register may be used here
+    :"memory"
+    );
+    #endif
+
+    //switch to local stack from trapped client's stack, outermost trap only: an IRQ taken while a handler runs may trap again
+    //(guest ISR's PIC EOI), and switching again would reset esp over the outer handler's frames and its saved client stack.
+    //depth is counted before switching and after switching back, so a trap nested anywhere in between stays on the current stack.
     #if HDPMIPT_SWITCH_STACK
     asm(
+    "incl %2 \n\t"
+    "cmpl $1, %2 \n\t"
+    "jne 7f \n\t"
     "mov %%esp, %0 \n\t"
     "mov %%ss, %%sp \n\t"
     "mov %%sp, %1 \n\t"
-    "lss %2, %%esp \n\t"
-    :"=m"(HDPMIPT_OldESP[0]),"=m"(HDPMIPT_OldESP[1])
+    "lss %3, %%esp \n\t"
+    "7: \n\t"
+    :"=m"(HDPMIPT_OldESP[0]),"=m"(HDPMIPT_OldESP[1]),"+m"(HDPMIPT_TrapDepth)
     :"m"(HDPMIPT_NewStack[0])
     :"memory"
     );
@@ -86,7 +170,15 @@ static void __attribute__((naked)) HDPMIPT_TrapHandlerWrapper()
     HDPMIPT_TrapHandler();
 
     #if HDPMIPT_SWITCH_STACK
-    asm("lss %0, %%esp" : :"m"(HDPMIPT_OldESP[0]) ); //restore stack
+    asm(
+    "cmpl $1, %0 \n\t"
+    "jne 8f \n\t"
+    "lss %1, %%esp \n\t" //restore stack
+    "8: decl %0 \n\t"
+    :"+m"(HDPMIPT_TrapDepth)
+    :"m"(HDPMIPT_OldESP[0])
+    :"memory"
+    );
     #endif
 
     asm("lret"); //retf
@@ -175,7 +267,117 @@ BOOL HDPMIPT_Detect()
     return result && (entry.edi || entry.es);
 }
 
-BOOL HDPMIPT_Install_IOPortTrap(uint16_t start, uint16_t end, QEMM_IODT* inputp iodt, uint16_t count, QEMM_IOPT* outputp iopt)
+//merged port ranges of all trap sets. link's table replaced by iodt (swap), or iodt added if link is NULL (install)
+static int HDPMIPT_MergeRanges(const QEMM_IODT_LINK* replace, const QEMM_IODT* iodt, int count, HDPMIPT_RANGE* ranges)
+{
+    memset(HDPMIPT_PortMap, 0, sizeof(HDPMIPT_PortMap));
+    for(const QEMM_IODT_LINK* link = HDPMIPT_IODT_header.next; link; link = link->next)
+    {
+        if(link == replace)
+            continue;
+        for(int i = 0; i < link->count; ++i)
+            HDPMIPT_PortMap[(link->iodt[i].port&0xFFFF)>>5] |= 1UL<<(link->iodt[i].port&0x1F);
+    }
+    for(int i = 0; i < count; ++i)
+        HDPMIPT_PortMap[(iodt[i].port&0xFFFF)>>5] |= 1UL<<(iodt[i].port&0x1F);
+
+    int n = 0;
+    for(uint32_t port = 0; port <= 0xFFFF; ++port)
+    {
+        if(HDPMIPT_PortMap[port>>5] == 0)
+        {
+            port |= 0x1F;
+            continue;
+        }
+        if(!(HDPMIPT_PortMap[port>>5]&(1UL<<(port&0x1F))))
+            continue;
+        BOOL gap = port >= HDPMIPT_MERGE_MIN_PORT && n > 0 && (port&~(HDPMIPT_MERGE_BLOCK-1)) == (ranges[n-1].end&~(HDPMIPT_MERGE_BLOCK-1));
+        if(n > 0 && port <= ranges[n-1].end + 1U + (gap ? HDPMIPT_MERGE_GAP : 0))
+            ranges[n-1].end = (uint16_t)port;
+        else
+        {
+            if(n == HDPMIPT_MAX_RANGES)
+                return -1;
+            ranges[n].start = ranges[n].end = (uint16_t)port;
+            ranges[n].handle = 0;
+            ++n;
+        }
+    }
+    return n;
+}
+
+static BOOL HDPMIPT_HasHandle(const HDPMIPT_RANGE* ranges, int count, uint32_t handle)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        if(ranges[i].handle == handle)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+//get host traps for new ranges: identical installed ranges are kept, others installed. nothing changed on failure
+static BOOL HDPMIPT_InstallRanges(HDPMIPT_RANGE* ranges, int count)
+{
+    uint32_t removed = 0; //old ranges uninstalled for overlap, reinstalled on failure
+    for(int i = 0; i < count; ++i)
+    {
+        for(int j = 0; j < HDPMIPT_RangeCount && !ranges[i].handle; ++j)
+        {
+            if(HDPMIPT_Ranges[j].start == ranges[i].start && HDPMIPT_Ranges[j].end == ranges[i].end)
+                ranges[i].handle = HDPMIPT_Ranges[j].handle;
+        }
+        if(ranges[i].handle)
+            continue;
+        ranges[i].handle = HDPMI_Internal_InstallTrap(&HDPMIPT_Entry, ranges[i].start, ranges[i].end, &HDPMIPT_TrapHandlerWrapper);
+        if(!ranges[i].handle) //host may not allow overlapped traps: remove old ones first
+        {
+            for(int j = 0; j < HDPMIPT_RangeCount; ++j)
+            {
+                HDPMIPT_RANGE* old = &HDPMIPT_Ranges[j];
+                if(old->handle && old->start <= ranges[i].end && ranges[i].start <= old->end && !HDPMIPT_HasHandle(ranges, i, old->handle))
+                {
+                    HDPMI_Internal_UninstallTrap(&HDPMIPT_Entry, old->handle);
+                    old->handle = 0;
+                    removed |= 1UL<<j;
+                }
+            }
+            ranges[i].handle = HDPMI_Internal_InstallTrap(&HDPMIPT_Entry, ranges[i].start, ranges[i].end, &HDPMIPT_TrapHandlerWrapper);
+        }
+        if(!ranges[i].handle)
+        {
+            _LOG("Failed to install HDPMI io port trap %x-%x.\n", ranges[i].start, ranges[i].end);
+            for(int j = 0; j < i; ++j)
+            {
+                if(!HDPMIPT_HasHandle(HDPMIPT_Ranges, HDPMIPT_RangeCount, ranges[j].handle))
+                    HDPMI_Internal_UninstallTrap(&HDPMIPT_Entry, ranges[j].handle);
+            }
+            for(int j = 0; j < HDPMIPT_RangeCount; ++j)
+            {
+                HDPMIPT_RANGE* old = &HDPMIPT_Ranges[j];
+                if((removed&(1UL<<j)) && !(old->handle = HDPMI_Internal_InstallTrap(&HDPMIPT_Entry, old->start, old->end, &HDPMIPT_TrapHandlerWrapper)))
+                    _LOG("Failed to restore HDPMI io port trap %x-%x.\n", old->start, old->end);
+            }
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+//remove host traps not used by new ranges, after dispatch switched to new tables
+static void HDPMIPT_CommitRanges(const HDPMIPT_RANGE* ranges, int count)
+{
+    for(int j = 0; j < HDPMIPT_RangeCount; ++j)
+    {
+        uint32_t handle = HDPMIPT_Ranges[j].handle;
+        if(handle && !HDPMIPT_HasHandle(ranges, count, handle) && !HDPMI_Internal_UninstallTrap(&HDPMIPT_Entry, handle))
+            _LOG("Failed to uninstall HDPMI io port trap.\n");
+    }
+    memcpy(HDPMIPT_Ranges, ranges, sizeof(HDPMIPT_RANGE)*count);
+    HDPMIPT_RangeCount = count;
+}
+
+BOOL HDPMIPT_Install_IOPortTrap(QEMM_IODT* inputp iodt, uint16_t count, QEMM_IOPT* outputp iopt)
 {
     assert(iopt);
     if(HDPMIPT_IODT_header.next == NULL)
@@ -188,21 +390,22 @@ BOOL HDPMIPT_Install_IOPortTrap(uint16_t start, uint16_t end, QEMM_IODT* inputp
             return FALSE;
         }
         //_LOG("HDPMI vendor entry: %04x:%08x\n", HDPMIPT_Entry.es, HDPMIPT_Entry.edi);
+        #if HDPMIPT_SWITCH_STACK
+        HDPMIPT_NewStack[0] = (uintptr_t)malloc(HDPMIPT_STACKSIZE) + HDPMIPT_STACKSIZE - 8;
+        HDPMIPT_NewStack[1] = HDPMIPT_GetDS();
+        #endif
     }
 
-    uint32_t handle = HDPMI_Internal_InstallTrap(&HDPMIPT_Entry, start, end, &HDPMIPT_TrapHandlerWrapper);
-    if(!handle)
+    HDPMIPT_RANGE ranges[HDPMIPT_MAX_RANGES];
+    int n = HDPMIPT_MergeRanges(NULL, iodt, count, ranges);
+    if(n < 0 || !HDPMIPT_InstallRanges(ranges, n))
     {
         _LOG("Failed to install HDPMI io port trap.\n");
-        return FALSE;
-    }
-    
-    if(HDPMIPT_IODT_header.next == NULL)
-    {
         #if HDPMIPT_SWITCH_STACK
-        HDPMIPT_NewStack[0] = (uintptr_t)malloc(HDPMIPT_STACKSIZE) + HDPMIPT_STACKSIZE - 8;
-        HDPMIPT_NewStack[1] = HDPMIPT_GetDS();
+        if(HDPMIPT_IODT_header.next == NULL)
+            free((void*)(HDPMIPT_NewStack[0] - HDPMIPT_STACKSIZE + 8));
         #endif
+        return FALSE;
     }
     
     QEMM_IODT* Iodt = (QEMM_IODT*)malloc(sizeof(QEMM_IODT)*count);
@@ -213,25 +416,56 @@ BOOL HDPMIPT_Install_IOPortTrap(uint16_t start, uint16_t end, QEMM_IODT* inputp
     newlink->count = count;
     newlink->prev = HDPMIPT_IODT_Link;
     newlink->next = NULL;
+    CLIS();
     HDPMIPT_IODT_Link->next = newlink;
     HDPMIPT_IODT_Link = newlink;
+    QEMM_BuildDispatchTable(&HDPMIPT_IODT_header, HDPMIPT_DispatchTable);
+    STIL();
+    HDPMIPT_CommitRanges(ranges, n);
     iopt->memory = (uintptr_t)newlink;
-    iopt->handle = handle;
+    iopt->handle = 0; //host traps are shared by all sets
     return TRUE;
 }
 
-BOOL HDPMIPT_Uninstall_IOPortTrap(QEMM_IOPT* inputp iopt)
+BOOL HDPMIPT_Swap_IOPortTrap(QEMM_IOPT* inputp iopt, QEMM_IODT* inputp iodt, uint16_t count)
 {
+    QEMM_IODT_LINK* link = (QEMM_IODT_LINK*)iopt->memory;
+    HDPMIPT_RANGE ranges[HDPMIPT_MAX_RANGES];
+    int n = HDPMIPT_MergeRanges(link, iodt, count, ranges);
+    if(n < 0 || !HDPMIPT_InstallRanges(ranges, n))
+    {
+        _LOG("Failed to swap HDPMI io port trap.\n");
+        return FALSE;
+    }
+
+    QEMM_IODT* Iodt = (QEMM_IODT*)malloc(sizeof(QEMM_IODT)*count);
+    memcpy(Iodt, iodt, sizeof(QEMM_IODT)*count);
+    QEMM_IODT* old = link->iodt;
     CLIS();
+    link->iodt = Iodt;
+    link->count = count;
+    QEMM_BuildDispatchTable(&HDPMIPT_IODT_header, HDPMIPT_DispatchTable);
+    STIL();
+    HDPMIPT_CommitRanges(ranges, n);
+    free(old);
+    return TRUE;
+}
+
+BOOL HDPMIPT_Uninstall_IOPortTrap(QEMM_IOPT* inputp iopt)
+{
     QEMM_IODT_LINK* link = (QEMM_IODT_LINK*)iopt->memory;
+    HDPMIPT_RANGE ranges[HDPMIPT_MAX_RANGES];
+    int n = HDPMIPT_MergeRanges(link, NULL, 0, ranges);
+    BOOL remap = n >= 0 && HDPMIPT_InstallRanges(ranges, n); //if failed, old host traps stay and pass through
+    CLIS();
     link->prev->next = link->next;
     if(link->next) link->next->prev = link->prev;
     if(HDPMIPT_IODT_Link == link)
         HDPMIPT_IODT_Link = link->prev;
+    QEMM_BuildDispatchTable(&HDPMIPT_IODT_header, HDPMIPT_DispatchTable);
     STIL();
-    BOOL result = HDPMI_Internal_UninstallTrap(&HDPMIPT_Entry, iopt->handle);
-    if(!result)
-        _LOG("Failed to uninstall HDPMI io port trap.\n");
+    if(remap)
+        HDPMIPT_CommitRanges(ranges, n);
     free(link->iodt);
     free(link);
     
@@ -6,7 +6,11 @@
 
 BOOL HDPMIPT_Detect();
 
-BOOL HDPMIPT_Install_IOPortTrap(uint16_t start, uint16_t end, QEMM_IODT* inputp iodt, uint16_t count, QEMM_IOPT* outputp iopt);
+//ports of all installed sets are merged into as few host traps as possible (ports in gaps pass through)
+BOOL HDPMIPT_Install_IOPortTrap(QEMM_IODT* inputp iodt, uint16_t count, QEMM_IOPT* outputp iopt);
+
+//replace an installed set in one step. ports in both old & new set stay trapped
+BOOL HDPMIPT_Swap_IOPortTrap(QEMM_IOPT* inputp iopt, QEMM_IODT* inputp iodt, uint16_t count);
 
 BOOL HDPMIPT_Uninstall_IOPortTrap(QEMM_IOPT* inputp iopt);
 
@@ -13,6 +13,7 @@
 #include <untrapio.h>
 #include "qemm.h"
 #include "hdpmipt.h"
+#include "pipeline.h"
 
 #include <mpxplay.h>
 #include <au_mixer/mix_func.h>
@@ -21,42 +22,79 @@
 #define MAIN_SBEMU_VER "1.0 beta3"
 #endif
 
-#define MAIN_TRAP_PIC_ONDEMAND 1
+#define MAIN_TRAP_PIC_ONDEMAND 0 //install PIC traps per virtual IRQ. otherwise they stay installed and VIRQ keeps the guest view
 #define MAIN_INSTALL_RM_ISR 1 //not needed. but to workaround some rm games' problem. need RAW_HOOk in dpmi_dj2.c
 #define MAIN_DOUBLE_OPL_VOLUME 1 //hack: double the amplitude of OPL PCM. should be 1 or 0
+#define MAIN_PROFILE 0 //log CPU cycles per output frame of each interrupt stage. needs RDTSC (586+) and DEBUG log
 
 #define MAIN_TSR_INT 0x2D   //AMIS multiplex. TODO: 0x2F?
 #define MAIN_TSR_INTSTART_ID 0x01 //start id
 
 mpxplay_audioout_info_s aui = {0};
 
-#define MAIN_PCM_SAMPLESIZE 16384
-
-static int16_t MAIN_OPLPCM[MAIN_PCM_SAMPLESIZE+256];
-static int16_t MAIN_PCM[MAIN_PCM_SAMPLESIZE+256];
+#define MAIN_SB_MAXBLOCK (65536*2) //max DSP transfer in bytes (16bit)
+
+//ISR scratch arena: one block allocated (and locked, _CRT0_FLAG_LOCK_MEMORY) at startup, sized from the card DMA buffer.
+//persistent buffers come first, per interrupt buffers are bump allocated above MAIN_ArenaMark and dropped on next interrupt.
+static uint8_t* MAIN_Arena;
+static uint32_t MAIN_ArenaSize;
+static uint32_t MAIN_ArenaMark;
+static uint32_t MAIN_ArenaUsed;
+static uint32_t MAIN_ArenaPeak; //high water mark
+
+static PIPELINE MAIN_Pipe; //buffers, gains and resamplers of the interrupt audio pipeline
+static uint32_t MAIN_DMABUF_Size;
+
+#if MAIN_PROFILE
+#define MAIN_PROFILE_INTERVAL 256 //interrupts per report
+static const char* MAIN_ProfileNames[PIPELINE_STAGES] = {"convert", "resample", "opl", "mix"};
+static uint64_t MAIN_ProfileCycles[PIPELINE_STAGES];
+static uint32_t MAIN_ProfileFrames;
+static uint32_t MAIN_ProfileInts;
+#endif
+static int MAIN_FollowCandidate; //guest rate waiting to be applied to the card
+static int MAIN_FollowCount; //interrupts the candidate has been seen
+static volatile int MAIN_FollowPending; //guest rate to retune the card to, applied from timer interrupt. 0: none
+#define MAIN_FOLLOW_FAILED_MAX 8 //failed rates remembered
+static int MAIN_FollowFailed[MAIN_FOLLOW_FAILED_MAX]; //guest rates the card couldn't run at, oldest overwritten
+static int MAIN_FollowFailedCount;
+static int MAIN_HWVolume = -1; //master volume (0-100) for card mixer, with SB mixer applied
+static uint32_t MAIN_TSCPerUS; //TSC cycles per microsecond. 0: no TSC
+static BOOL MAIN_HWVolumeDirty;
 
 static DPMI_ISR_HANDLE MAIN_IntHandlePM;
 static DPMI_ISR_HANDLE MAIN_IntHandleRM;
+static DPMI_ISR_HANDLE MAIN_TimerHandlePM;
+static INTCONTEXT MAIN_TimerContext;
 static DPMI_REG MAIN_IntREG;
 static INTCONTEXT MAIN_IntContext;
-static uint32_t MAIN_DMA_Addr = 0;
-static uint32_t MAIN_DMA_Size = 0;
-static uint32_t MAIN_DMA_MappedAddr = 0;
 static uint8_t MAIN_QEMM_Present = 0;
 static uint8_t MAIN_HDPMI_Present = 0;
+static uint8_t MAIN_NearLinear = 0; //conventional memory accessible as near ptr
 static uint8_t MAIN_InINT;
 
 SBEMU_EXTFUNS MAIN_SbemuExtFun;
 
+static BOOL MAIN_ArenaInit();
+static void MAIN_UpdateGains();
+static void MAIN_SetCardRate(int samplerate, BOOL exact);
+static void MAIN_FollowRate(int samplerate);
+static void MAIN_FollowRetune();
+static void MAIN_RaiseIRQ();
+static void* MAIN_ArenaAlloc(uint32_t bytes);
 static void MAIN_Interrupt();
 static void MAIN_InterruptPM();
 static void MAIN_InterruptRM();
+static void MAIN_TimerPM();
 
 static DPMI_ISR_HANDLE MAIN_TSRIntHandle;
 static DPMI_REG MAIN_TSRREG;
 static uint32_t MAIN_TSR_INT_FNO = MAIN_TSR_INTSTART_ID;
 static uint32_t MAIN_ISR_DOSID;
 static const char MAIN_ISR_DOSID_String[] = "Crazii  SBEMU   Sound Blaster emulation on AC97"; //8:8:asciiz
+static uint32_t MAIN_CalibrateTSC();
+static int MAIN_SetWSPolicy(int policy);
+static void MAIN_UpdatePICShadow(BOOL trapped);
 static void MAIN_TSR_InstallationCheck();
 static void MAIN_TSR_Interrupt();
 
@@ -199,14 +237,8 @@ QEMM_IOPT OPL3IOPT_PM;
 QEMM_IOPT MAIN_VDMA_IOPT;
 QEMM_IOPT MAIN_VIRQ_IOPT;
 QEMM_IOPT MAIN_SB_IOPT;
-QEMM_IOPT MAIN_VDMA_IOPT_PM1;
-QEMM_IOPT MAIN_VDMA_IOPT_PM2;
-QEMM_IOPT MAIN_VDMA_IOPT_PM3;
-QEMM_IOPT MAIN_VHDMA_IOPT_PM1;
-QEMM_IOPT MAIN_VHDMA_IOPT_PM2;
-QEMM_IOPT MAIN_VHDMA_IOPT_PM3;
-QEMM_IOPT MAIN_VIRQ_IOPT_PM1;
-QEMM_IOPT MAIN_VIRQ_IOPT_PM2;
+QEMM_IOPT MAIN_VDMA_IOPT_PM;
+QEMM_IOPT MAIN_VIRQ_IOPT_PM;
 QEMM_IOPT MAIN_SB_IOPT_PM;
 
 #define MAIN_SETCMD_SET 0x01 //set in command line
@@ -231,10 +263,17 @@ struct MAIN_OPT
     "/RM", "Support real mode games", TRUE, 0,
     "/O", "Select output. 0: headphone, 1: speaker. Intel HDA only", 1, 0,
     "/VOL", "Set master volume (0-9)", 7, 0,
-    "/K", "Set internal sample rate, valid value: 22050,44100", 0x22050, 0,
+    "/K", "Set output sample rate, any rate supported by the sound card, i.e. 22050,44100,48000", 0x22050, 0,
     "/SCL", "List installed sound cards", 0, MAIN_SETCMD_HIDDEN,
     "/SC", "Select sound card index in list (/SCL)", 0, MAIN_SETCMD_HIDDEN,
     "/R", "Reset sound card driver", 0, MAIN_SETCMD_HIDDEN,
+    "/Q", "Set resampling quality, 0: linear, 1: windowed-sinc (more CPU)", 0, 0,
+    "/FR", "Follow sample rate of games on the sound card if supported, no resampling", FALSE, 0,
+    "/MX", "Apply SB master volume on the sound card's hardware mixer", FALSE, 0,
+    "/WS", "DSP write status, 0: toggle busy/ready, 1: timed busy (586+), 2: always ready. fewer traps with 1,2", SBEMU_WS_TOGGLE, 0,
+    "/LM", "Mix OPL and digital audio linearly (louder OPL, may clip) instead of the non-linear curve", FALSE, 0,
+    "/NP", "Near access to conventional memory: faster DMA & DSP status. sets 4GB DS limit, see README", FALSE, 0,
+    "/STAT", "Show & reset I/O trap statistics of the running instance", FALSE, MAIN_SETCMD_HIDDEN,
 
     NULL, NULL, 0,
 };
@@ -255,10 +294,48 @@ enum EOption
     OPT_SCLIST,
     OPT_SC,
     OPT_RESET,
+    OPT_QUALITY,
+    OPT_FOLLOW,
+    OPT_HWMIXER,
+    OPT_WSPOLICY,
+    OPT_LINEARMIX,
+    OPT_NEARPTR,
+    OPT_STAT,
 
     OPT_COUNT,
 };
 
+#define MAIN_MIN_RATE 8000
+#define MAIN_MAX_RATE 192000
+#define MAIN_FOLLOW_MAX_RATE 48000 //above any SB rate
+#define MAIN_FOLLOW_HOLD 4 //interrupts a new guest rate must last before retuning the card
+#define MAIN_FOLLOW_MIN_OPL_RATE 22050 //lowest rate followed with OPL on: OPL runs at card rate, lower ones only cost an OPL setup for worse output
+#define MAIN_RATE_TOLERANCE PIPELINE_RATE_TOLERANCE //rates this close are not resampled
+#define MAIN_WS_BUSY_US 10 //DSP busy time after each command/data byte for SBEMU_WS_TIMED
+#define MAIN_IRQ_DELAY_US 10 //latency of IRQ requested by DSP F2h/F3h. actual latency is rounded up to card/timer interrupts
+
+//sample rates are given in decimal digits but parsed as hex like other options: /K48000 => 0x48000. return -1 if not decimal
+static int MAIN_BCD2Int(uint32_t bcd)
+{
+    int value = 0;
+    for(int shift = 28; shift >= 0; shift -= 4)
+    {
+        int digit = (bcd >> shift) & 0xF;
+        if(digit > 9)
+            return -1;
+        value = value * 10 + digit;
+    }
+    return value;
+}
+
+static uint32_t MAIN_Int2BCD(int value)
+{
+    uint32_t bcd = 0;
+    for(int shift = 0; value > 0 && shift < 32; shift += 4, value /= 10)
+        bcd |= (uint32_t)(value % 10) << shift;
+    return bcd;
+}
+
 //T1~T6 maps
 static const char* MAIN_SBTypeString[] =
 {
@@ -281,25 +358,73 @@ static int MAIN_SB_DSPVersion[] =
     0x0400,
 };
 
-static void MAIN_InvokeIRQ(uint8_t irq) //generate virtual IRQ
+static void MAIN_InvokeIRQ(uint8_t irq, INTCONTEXT* context) //generate virtual IRQ on interrupted context
 {
     #if MAIN_TRAP_PIC_ONDEMAND
     if(MAIN_Options[OPT_RM].value) QEMM_Install_IOPortTrap(MAIN_VIRQ_IODT, countof(MAIN_VIRQ_IODT), &MAIN_VIRQ_IOPT);
-    if(MAIN_Options[OPT_PM].value)
-    {
-        HDPMIPT_Install_IOPortTrap(0x20, 0x21, MAIN_VIRQ_IODT, 2, &MAIN_VIRQ_IOPT_PM1);
-        HDPMIPT_Install_IOPortTrap(0xA0, 0xA1, MAIN_VIRQ_IODT+2, 2, &MAIN_VIRQ_IOPT_PM2);
-    }
+    if(MAIN_Options[OPT_PM].value) HDPMIPT_Install_IOPortTrap(MAIN_VIRQ_IODT, countof(MAIN_VIRQ_IODT), &MAIN_VIRQ_IOPT_PM);
+    MAIN_UpdatePICShadow(TRUE);
     #endif
-    VIRQ_Invoke(irq, &MAIN_IntContext.regs, MAIN_IntContext.EFLAGS&CPU_VMFLAG);
+    VIRQ_Invoke(irq, &context->regs, context->EFLAGS&CPU_VMFLAG);
     #if MAIN_TRAP_PIC_ONDEMAND
     if(MAIN_Options[OPT_RM].value) QEMM_Uninstall_IOPortTrap(&MAIN_VIRQ_IOPT);
-    if(MAIN_Options[OPT_PM].value)
+    if(MAIN_Options[OPT_PM].value) HDPMIPT_Uninstall_IOPortTrap(&MAIN_VIRQ_IOPT_PM);
+    MAIN_UpdatePICShadow(FALSE); //guest PIC writes not seen from now on
+    #endif
+}
+
+//TSC cycles per microsecond, measured over one BIOS timer tick (54925us). called on startup with interrupts enabled
+static uint32_t MAIN_CalibrateTSC()
+{
+    #ifdef DJGPP //make vscode happy
+    uint32_t regs[4];
+    if(!PLTFM_CPUID(1, regs) || !(regs[3]&0x10)) //TSC
+        return 0;
+    uint32_t tick = DPMI_LoadD(0x46C);
+    while(DPMI_LoadD(0x46C) == tick);
+    uint64_t tsc = PLTFM_RDTSC();
+    tick = DPMI_LoadD(0x46C);
+    while(DPMI_LoadD(0x46C) == tick);
+    return (uint32_t)((PLTFM_RDTSC() - tsc) / 54925);
+    #else
+    return 0;
+    #endif
+}
+
+//return the policy applied: timed needs TSC
+static int MAIN_SetWSPolicy(int policy)
+{
+    if(policy == SBEMU_WS_TIMED && MAIN_TSCPerUS == 0)
+        policy = SBEMU_WS_TOGGLE;
+    SBEMU_SetWSPolicy(policy, MAIN_TSCPerUS * MAIN_WS_BUSY_US);
+    return policy;
+}
+
+//cache real PIC masks only while guests of both modes write the PIC through traps (VIRQ reports them):
+//always with persistent PIC traps, only during virtual IRQs with on-demand traps. dropped (invalidated) otherwise
+static void MAIN_UpdatePICShadow(BOOL trapped)
+{
+    PIC_ShadowIRQMask(trapped && MAIN_Options[OPT_RM].value && MAIN_Options[OPT_PM].value);
+}
+
+//let real mode trap stub answer DSP status polls and queue OPL writes: state kept in stub's DOS memory. needs near access to conventional memory.
+static void MAIN_ShareStubState()
+{
+    uint32_t linear = MAIN_Options[OPT_RM].value && MAIN_NearLinear ? QEMM_GetSBState() : 0;
+    if(linear == 0)
     {
-        HDPMIPT_Uninstall_IOPortTrap(&MAIN_VIRQ_IOPT_PM1);
-        HDPMIPT_Uninstall_IOPortTrap(&MAIN_VIRQ_IOPT_PM2);
+        SBEMU_SetDSPStatus(NULL);
+        OPL3EMU_SetIndexLatch(NULL);
+        return;
     }
-    #endif
+    QEMM_SBSTATE* state = (QEMM_SBSTATE*)DPMI_L2PTR(linear);
+    SBEMU_SetDSPStatus(&state->DSP);
+    state->SBPort = MAIN_Options[OPT_ADDR].value;
+    if(MAIN_Options[OPT_OPL].value)
+        OPL3EMU_AddPostRing((OPL3EMU_POSTRING*)DPMI_L2PTR(QEMM_GetOPLPostRing()));
+    //stub posts 389h writes with its own index latch: keep it the same as emulation's before enabling posting
+    OPL3EMU_SetIndexLatch(MAIN_Options[OPT_OPL].value ? (volatile uint8_t*)DPMI_L2PTR(QEMM_GetOPLIndexLatch()) : NULL);
+    state->OPLPost = MAIN_Options[OPT_OPL].value ? 1 : 0;
 }
 
 static void MAIN_SetBlasterEnv(struct MAIN_OPT* opt) //alter BLASTER env.
@@ -399,15 +524,54 @@ int main(int argc, char* argv[])
         printf("Error: Invalid Volume.\n");
         return 1;
     }
-    if(MAIN_Options[OPT_RATE].value != 0x22050 && MAIN_Options[OPT_RATE].value != 0x44100)
+    if(MAIN_BCD2Int(MAIN_Options[OPT_RATE].value) < MAIN_MIN_RATE || MAIN_BCD2Int(MAIN_Options[OPT_RATE].value) > MAIN_MAX_RATE)
     {
         printf("Error: Invalid Sample rate.\n");
         return 1;
     }
+    if(MAIN_Options[OPT_QUALITY].value != 0 && MAIN_Options[OPT_QUALITY].value != 1)
+    {
+        printf("Error: Invalid resampling quality.\n");
+        return 1;
+    }
+    if(MAIN_Options[OPT_FOLLOW].value != 0 && MAIN_Options[OPT_FOLLOW].value != 1)
+    {
+        printf("Error: Invalid sample rate follow mode.\n");
+        return 1;
+    }
+    if(MAIN_Options[OPT_HWMIXER].value != 0 && MAIN_Options[OPT_HWMIXER].value != 1)
+    {
+        printf("Error: Invalid hardware mixer mode.\n");
+        return 1;
+    }
+    if(MAIN_Options[OPT_WSPOLICY].value < SBEMU_WS_TOGGLE || MAIN_Options[OPT_WSPOLICY].value > SBEMU_WS_READY)
+    {
+        printf("Error: Invalid DSP write status mode.\n");
+        return 1;
+    }
+    if(MAIN_Options[OPT_LINEARMIX].value != 0 && MAIN_Options[OPT_LINEARMIX].value != 1)
+    {
+        printf("Error: Invalid mixing mode.\n");
+        return 1;
+    }
+    if(MAIN_Options[OPT_NEARPTR].value != 0 && MAIN_Options[OPT_NEARPTR].value != 1)
+    {
+        printf("Error: Invalid near pointer mode.\n");
+        return 1;
+    }
     if(MAIN_Options[OPT_TYPE].value != 6)
         MAIN_Options[OPT_HDMA].value = MAIN_Options[OPT_DMA].value; //16 bit transfer through 8 bit dma
 
     DPMI_Init();
+    //opt-in: the 4GB DS limit drops our segment protection, stray writes of the TSR can reach DOS or the game.
+    //without it guest DMA buffers are bounce copied and DSP status polls of real mode games go to protected mode.
+    if(MAIN_Options[OPT_NEARPTR].value)
+    {
+        MAIN_NearLinear = DPMI_EnableNearLinear(); //guest DMA buffers below 1M read in place
+        if(!MAIN_NearLinear)
+            printf("Near pointer access not supported by the DPMI host, disabled.\n");
+        MAIN_Options[OPT_NEARPTR].value = MAIN_NearLinear;
+    }
 
     MAIN_QEMM_Present = TRUE;
     if(MAIN_Options[OPT_RM].value)
@@ -436,6 +600,11 @@ int main(int argc, char* argv[])
 
     //TSR installation check: update parameter & exit if already installed
     MAIN_TSR_InstallationCheck();
+    if(MAIN_Options[OPT_STAT].value)
+    {
+        printf("SBEMU is not active.\n");
+        return 1;
+    }
 
     MAIN_SetBlasterEnv(MAIN_Options);
 
@@ -482,7 +651,7 @@ int main(int argc, char* argv[])
             printf("Error: Failed installing IO port trap for QEMM.\n");
             return 1;
         }
-        if(enablePM && !HDPMIPT_Install_IOPortTrap(0x388, 0x38B, MAIN_OPL3IODT, 4, &OPL3IOPT_PM))
+        if(enablePM && !HDPMIPT_Install_IOPortTrap(MAIN_OPL3IODT, 4, &OPL3IOPT_PM))
         {
             printf("Error: Failed installing IO port trap for HDPMI.\n");
             if(enableRM) QEMM_Uninstall_IOPortTrap(&OPL3IOPT);
@@ -497,8 +666,16 @@ int main(int argc, char* argv[])
     MAIN_SbemuExtFun.RaiseIRQ = NULL;
     MAIN_SbemuExtFun.DMA_Size = &VDMA_GetCounter;
     MAIN_SbemuExtFun.DMA_Write = &VDMA_WriteData;
+    MAIN_SbemuExtFun.MixerChanged = &MAIN_UpdateGains;
 
     SBEMU_Init(MAIN_Options[OPT_IRQ].value, MAIN_Options[OPT_DMA].value, MAIN_Options[OPT_HDMA].value, MAIN_SB_DSPVersion[MAIN_Options[OPT_TYPE].value], &MAIN_SbemuExtFun);
+    MAIN_TSCPerUS = MAIN_CalibrateTSC();
+    SBEMU_SetIRQDelay(MAIN_TSCPerUS * MAIN_IRQ_DELAY_US);
+    if(MAIN_SetWSPolicy(MAIN_Options[OPT_WSPOLICY].value) != MAIN_Options[OPT_WSPOLICY].value)
+    {
+        printf("No time stamp counter, DSP write status falls back to toggle mode.\n");
+        MAIN_Options[OPT_WSPOLICY].value = SBEMU_WS_TOGGLE;
+    }
     VDMA_Virtualize(MAIN_Options[OPT_DMA].value, TRUE);
     if(MAIN_Options[OPT_TYPE].value == 6)
         VDMA_Virtualize(MAIN_Options[OPT_HDMA].value, TRUE);
@@ -510,27 +687,23 @@ int main(int argc, char* argv[])
     printf("Sound Blaster %s emulation enabled at Adress: %x, IRQ: %x, DMA: %x\n", MAIN_SBTypeString[MAIN_Options[OPT_TYPE].value], MAIN_Options[OPT_ADDR].value, MAIN_Options[OPT_IRQ].value, MAIN_Options[OPT_DMA].value);
 
     BOOL QEMMInstalledVDMA = !enableRM || QEMM_Install_IOPortTrap(MAIN_VDMA_IODT, countof(MAIN_VDMA_IODT), &MAIN_VDMA_IOPT);
-    #if MAIN_TRAP_PIC_ONDEMAND//will crash with VIRQ installed, do it temporarily. TODO: figure out why
+    #if MAIN_TRAP_PIC_ONDEMAND
     BOOL QEMMInstalledVIRQ = TRUE;
     #else
     BOOL QEMMInstalledVIRQ = !enableRM || QEMM_Install_IOPortTrap(MAIN_VIRQ_IODT, countof(MAIN_VIRQ_IODT), &MAIN_VIRQ_IOPT);
     #endif
     BOOL QEMMInstalledSB = !enableRM || QEMM_Install_IOPortTrap(SB_Iodt, SB_IodtCount, &MAIN_SB_IOPT);
 
-    BOOL HDPMIInstalledVDMA1 = !enablePM || HDPMIPT_Install_IOPortTrap(0x0, 0xF, MAIN_VDMA_IODT, 16, &MAIN_VDMA_IOPT_PM1);
-    BOOL HDPMIInstalledVDMA2 = !enablePM || HDPMIPT_Install_IOPortTrap(0x81, 0x83, MAIN_VDMA_IODT+16, 3, &MAIN_VDMA_IOPT_PM2);
-    BOOL HDPMIInstalledVDMA3 = !enablePM || HDPMIPT_Install_IOPortTrap(0x87, 0x87, MAIN_VDMA_IODT+19, 1, &MAIN_VDMA_IOPT_PM3);
-    BOOL HDPMIInstalledVHDMA1 = !enablePM || HDPMIPT_Install_IOPortTrap(0xC0, 0xDE, MAIN_VDMA_IODT+20, 16, &MAIN_VHDMA_IOPT_PM1);
-    BOOL HDPMIInstalledVHDMA2 = !enablePM || HDPMIPT_Install_IOPortTrap(0x89, 0x8B, MAIN_VDMA_IODT+36, 3, &MAIN_VHDMA_IOPT_PM2);
-    BOOL HDPMIInstalledVHDMA3 = !enablePM || HDPMIPT_Install_IOPortTrap(0x8F, 0x8F, MAIN_VDMA_IODT+39, 1, &MAIN_VHDMA_IOPT_PM3);
+    BOOL HDPMIInstalledVDMA = !enablePM || HDPMIPT_Install_IOPortTrap(MAIN_VDMA_IODT, countof(MAIN_VDMA_IODT), &MAIN_VDMA_IOPT_PM);
     #if MAIN_TRAP_PIC_ONDEMAND
-    BOOL HDPMIInstalledVIRQ1 = TRUE;
-    BOOL HDPMIInstalledVIRQ2 = TRUE;
+    BOOL HDPMIInstalledVIRQ = TRUE;
     #else
-    BOOL HDPMIInstalledVIRQ1 = !enablePM || HDPMIPT_Install_IOPortTrap(0x20, 0x21, MAIN_VIRQ_IODT, 2, &MAIN_VIRQ_IOPT_PM1);
-    BOOL HDPMIInstalledVIRQ2 = !enablePM || HDPMIPT_Install_IOPortTrap(0xA0, 0xA1, MAIN_VIRQ_IODT+2, 2, &MAIN_VIRQ_IOPT_PM2);
+    BOOL HDPMIInstalledVIRQ = !enablePM || HDPMIPT_Install_IOPortTrap(MAIN_VIRQ_IODT, countof(MAIN_VIRQ_IODT), &MAIN_VIRQ_IOPT_PM);
     #endif
-    BOOL HDPMIInstalledSB = !enablePM || HDPMIPT_Install_IOPortTrap(MAIN_Options[OPT_ADDR].value, MAIN_Options[OPT_ADDR].value+0x0F, SB_Iodt, SB_IodtCount, &MAIN_SB_IOPT_PM);
+    BOOL HDPMIInstalledSB = !enablePM || HDPMIPT_Install_IOPortTrap(SB_Iodt, SB_IodtCount, &MAIN_SB_IOPT_PM);
+    if(QEMMInstalledSB)
+        MAIN_ShareStubState();
+    MAIN_UpdatePICShadow(!MAIN_TRAP_PIC_ONDEMAND);
 
     BOOL TSR_ISR = FALSE;
     for(int i = MAIN_TSR_INTSTART_ID; i <= 0xFF; ++i)
@@ -554,15 +727,28 @@ int main(int argc, char* argv[])
     _LOG("sound card IRQ: %d\n", aui.card_irq);
     PIC_MaskIRQ(aui.card_irq);
     AU_ini_interrupts(&aui);
-    int samplerate = (MAIN_Options[OPT_RATE].value == 0x22050) ? 22050 : 44100;
+    int samplerate = MAIN_BCD2Int(MAIN_Options[OPT_RATE].value);
     mpxplay_audio_decoder_info_s adi = {NULL, 0, 1, samplerate, SBEMU_CHANNELS, SBEMU_CHANNELS, NULL, SBEMU_BITS, SBEMU_BITS/8, 0};
     AU_setrate(&aui, &adi);
+    //driver adjusts to its nearest supported rate: error if explicitly set, otherwise use card's rate
+    BOOL Rate = (aui.freq_card == samplerate) || !(MAIN_Options[OPT_RATE].setcmd&MAIN_SETCMD_SET);
+    MAIN_Options[OPT_RATE].value = MAIN_Int2BCD(aui.freq_card);
     AU_setmixer_init(&aui);
     AU_setmixer_outs(&aui, MIXER_SETMODE_ABSOLUTE, 100);
     //set volume
     AU_setmixer_one(&aui, AU_MIXCHAN_MASTER, MIXER_SETMODE_ABSOLUTE, MAIN_Options[OPT_VOL].value*100/9);
     if(MAIN_Options[OPT_OPL].value)
         OPL3EMU_Init(aui.freq_card); //aui.freq_card available after AU_setrate
+    mixer_speed_stream_init(&MAIN_Pipe.Resampler, 2, 0, aui.freq_card); //rate and resampler function set in interrupt
+    mixer_speed_stream_init(&MAIN_Pipe.DirectResampler, 1, aui.freq_card, aui.freq_card);
+    mixer_speed_stream_setsinc(&MAIN_Pipe.Resampler, MAIN_Options[OPT_QUALITY].value);
+    mixer_speed_stream_setsinc(&MAIN_Pipe.DirectResampler, MAIN_Options[OPT_QUALITY].value);
+    MAIN_Pipe.ResampleFunc = &mixer_speed_stream;
+    MAIN_Pipe.RaiseIRQ = &MAIN_RaiseIRQ;
+    #if MAIN_PROFILE
+    MAIN_Pipe.Cycles = MAIN_ProfileCycles;
+    #endif
+    BOOL Arena = MAIN_ArenaInit(); //card_dmasize available after AU_setrate
 
     BOOL PM_ISR = DPMI_InstallISR(PIC_IRQ2VEC(aui.card_irq), MAIN_InterruptPM, &MAIN_IntHandlePM) == 0;
     //set default ACK, to skip recursion of DOS/4GW
@@ -575,6 +761,7 @@ int main(int argc, char* argv[])
         }
     }
     HDPMIPT_InstallIRQACKHandler(aui.card_irq, MAIN_IntHandlePM.wrapper_cs, MAIN_IntHandlePM.wrapper_offset);
+    BOOL Timer_ISR = DPMI_InstallISR(PIC_IRQ2VEC(0), MAIN_TimerPM, &MAIN_TimerHandlePM) == 0; //after default ACKs: IRQ0 keeps the original one
     #if MAIN_INSTALL_RM_ISR
     BOOL RM_ISR = DPMI_InstallRealModeISR(PIC_IRQ2VEC(aui.card_irq), MAIN_InterruptRM, &MAIN_IntREG, &MAIN_IntHandleRM) == 0;
     #else
@@ -586,10 +773,9 @@ int main(int argc, char* argv[])
     AU_start(&aui);
 
     BOOL TSR = TRUE;
-    if(!PM_ISR || !RM_ISR || !TSR_ISR
+    if(!Rate || !Arena || !PM_ISR || !RM_ISR || !TSR_ISR || !Timer_ISR
     || !QEMMInstalledVDMA || !QEMMInstalledVIRQ || !QEMMInstalledSB
-    || !HDPMIInstalledVDMA1 || !HDPMIInstalledVDMA2 || !HDPMIInstalledVDMA3 || !HDPMIInstalledVHDMA1 || !HDPMIInstalledVHDMA2 || !HDPMIInstalledVHDMA3 
-    || !HDPMIInstalledVIRQ1 || !HDPMIInstalledVIRQ2 || !HDPMIInstalledSB
+    || !HDPMIInstalledVDMA || !HDPMIInstalledVIRQ || !HDPMIInstalledSB
     || !(TSR=DPMI_TSR()))
     {
         if(MAIN_Options[OPT_OPL].value)
@@ -606,17 +792,11 @@ int main(int argc, char* argv[])
         #endif
         if(enableRM && QEMMInstalledSB) QEMM_Uninstall_IOPortTrap(&MAIN_SB_IOPT);
 
-        if(!HDPMIInstalledVDMA1 || !HDPMIInstalledVDMA2 || !HDPMIInstalledVDMA3 || !HDPMIInstalledVHDMA1 || !HDPMIInstalledVHDMA2 || !HDPMIInstalledVHDMA3 || !HDPMIInstalledVIRQ1 || !HDPMIInstalledVIRQ2 || !HDPMIInstalledSB)
+        if(!HDPMIInstalledVDMA || !HDPMIInstalledVIRQ || !HDPMIInstalledSB)
             printf("Error: Failed installing IO port trap for HDPMI.\n");
-        if(enablePM && HDPMIInstalledVDMA1) HDPMIPT_Uninstall_IOPortTrap(&MAIN_VDMA_IOPT_PM1);
-        if(enablePM && HDPMIInstalledVDMA2) HDPMIPT_Uninstall_IOPortTrap(&MAIN_VDMA_IOPT_PM2);
-        if(enablePM && HDPMIInstalledVDMA3) HDPMIPT_Uninstall_IOPortTrap(&MAIN_VDMA_IOPT_PM3);
-        if(enablePM && HDPMIInstalledVHDMA1) HDPMIPT_Uninstall_IOPortTrap(&MAIN_VHDMA_IOPT_PM1);
-        if(enablePM && HDPMIInstalledVHDMA2) HDPMIPT_Uninstall_IOPortTrap(&MAIN_VHDMA_IOPT_PM2);
-        if(enablePM && HDPMIInstalledVHDMA3) HDPMIPT_Uninstall_IOPortTrap(&MAIN_VHDMA_IOPT_PM3);
+        if(enablePM && HDPMIInstalledVDMA) HDPMIPT_Uninstall_IOPortTrap(&MAIN_VDMA_IOPT_PM);
         #if !MAIN_TRAP_PIC_ONDEMAND
-        if(enablePM && HDPMIInstalledVIRQ1) HDPMIPT_Uninstall_IOPortTrap(&MAIN_VIRQ_IOPT_PM1);
-        if(enablePM && HDPMIInstalledVIRQ2) HDPMIPT_Uninstall_IOPortTrap(&MAIN_VIRQ_IOPT_PM2);
+        if(enablePM && HDPMIInstalledVIRQ) HDPMIPT_Uninstall_IOPortTrap(&MAIN_VIRQ_IOPT_PM);
         #endif
         if(enablePM && HDPMIInstalledSB) HDPMIPT_Uninstall_IOPortTrap(&MAIN_SB_IOPT_PM);
 
@@ -628,9 +808,16 @@ int main(int argc, char* argv[])
         #if MAIN_INSTALL_RM_ISR
         if(RM_ISR) DPMI_UninstallISR(&MAIN_IntHandleRM);
         #endif
+        if(!Timer_ISR)
+            printf("Error: Failed installing timer ISR.\n");
+        if(Timer_ISR) DPMI_UninstallISR(&MAIN_TimerHandlePM);
         if(!TSR_ISR)
             printf("Error: Failed installing TSR interrupt.\n");
         if(TSR_ISR) DPMI_UninstallISR(&MAIN_TSRIntHandle);
+        if(!Arena)
+            printf("Error: Failed allocating ISR buffers.\n");
+        if(!Rate)
+            printf("Error: Sample rate %d not supported by the sound card, nearest: %d.\n", samplerate, aui.freq_card);
 
         if(!TSR)
             printf("Error: Failed installing TSR.\n");
@@ -678,6 +865,216 @@ static void MAIN_InterruptRM()
     }
 }
 
+//timer interrupt: card retune requested by the card ISR (MAIN_FollowRate), done outside of the card's own ISR.
+//also raises due DSP IRQs (F2h/F3h) when the card interrupt doesn't (card stopped, or long card interrupt period)
+static void MAIN_TimerPM()
+{
+    HDPMIPT_GetInterrupContext(&MAIN_TimerContext);
+    if(MAIN_TimerContext.EFLAGS&CPU_VMFLAG)
+        DPMI_CallOldISR(&MAIN_TimerHandlePM);
+    else
+        DPMI_CallOldISRWithContext(&MAIN_TimerHandlePM, &MAIN_TimerContext.regs);
+    if(MAIN_InINT)
+        return;
+    if(MAIN_FollowPending)
+        MAIN_FollowRetune();
+    MAIN_InINT = TRUE; //card ISR chains while guest's handler runs
+    if(SBEMU_ServiceEvents(MAIN_TSCPerUS ? PLTFM_RDTSC() : 0))
+        MAIN_InvokeIRQ(SBEMU_GetIRQ(), &MAIN_TimerContext);
+    MAIN_InINT = FALSE;
+}
+
+//(re)size the arena for current card buffer. not for ISR use: may call malloc/free.
+static BOOL MAIN_ArenaInit()
+{
+    int dmasize = aui.card_dmasize;
+    if(MAIN_Options[OPT_FOLLOW].value && aui.freq_card < MAIN_FOLLOW_MAX_RATE) //card buffer grows with the rate when following: reserve for the highest
+        dmasize = dmasize * (MAIN_FOLLOW_MAX_RATE / 100) / (aui.freq_card / 100) + 4096;
+    int frames = dmasize / sizeof(int16_t) / 2 + 128; //max frames per interrupt
+    uint32_t pcmbytes = align(frames*2*sizeof(int16_t), 16);
+    MAIN_Pipe.SBPCM_Frames = frames*2; //room for 2x downsampling in one pass
+    MAIN_DMABUF_Size = min(MAIN_Pipe.SBPCM_Frames*2*sizeof(int16_t), MAIN_SB_MAXBLOCK);
+    uint32_t size = align(MAIN_Pipe.SBPCM_Frames*2*sizeof(int16_t), 16) + pcmbytes*2 + align(MAIN_DMABUF_Size, 16);
+    if(size > MAIN_ArenaSize)
+    {
+        free(MAIN_Arena);
+        MAIN_Arena = (uint8_t*)malloc(size);
+        MAIN_ArenaSize = MAIN_Arena ? size : 0;
+    }
+    MAIN_ArenaUsed = MAIN_ArenaMark = 0;
+    MAIN_Pipe.SBPCM = (int16_t*)MAIN_ArenaAlloc(MAIN_Pipe.SBPCM_Frames*2*sizeof(int16_t));
+    MAIN_Pipe.SBPCM_Count = 0;
+    MAIN_ArenaMark = MAIN_ArenaUsed;
+    _LOG("ISR arena: %d bytes\n", MAIN_ArenaSize);
+    return MAIN_Pipe.SBPCM != NULL;
+}
+
+static void* MAIN_ArenaAlloc(uint32_t bytes)
+{
+    bytes = align(bytes, 16);
+    if(MAIN_ArenaUsed + bytes > MAIN_ArenaSize)
+        return NULL;
+    void* ptr = MAIN_Arena + MAIN_ArenaUsed;
+    MAIN_ArenaUsed += bytes;
+    MAIN_ArenaPeak = max(MAIN_ArenaPeak, MAIN_ArenaUsed);
+    return ptr;
+}
+
+//recompute mixing gains from SB mixer registers, instead of on every interrupt. called by SBEMU on volume register writes.
+static void MAIN_UpdateGains()
+{
+    int32_t vol[2]; //left, right. 0~256
+    int32_t voicevol[2];
+    int32_t midivol[2];
+    if(MAIN_Options[OPT_TYPE].value == 1 || MAIN_Options[OPT_TYPE].value == 3) //SB2.0 and before
+    {
+        vol[0] = vol[1] = (SBEMU_GetMixerReg(SBEMU_MIXERREG_MASTERVOL) >> 1)*256/7;
+        voicevol[0] = voicevol[1] = (SBEMU_GetMixerReg(SBEMU_MIXERREG_VOICEVOL) >> 1)*256/3;
+        midivol[0] = midivol[1] = (SBEMU_GetMixerReg(SBEMU_MIXERREG_MIDIVOL) >> 1)*256/7;
+    }
+    else if(MAIN_Options[OPT_TYPE].value == 6) //SB16
+    {
+        vol[0] = (SBEMU_GetMixerReg(SBEMU_MIXERREG_MASTERSTEREO)>>4)*256/15; //4:4
+        vol[1] = (SBEMU_GetMixerReg(SBEMU_MIXERREG_MASTERSTEREO)&0xF)*256/15;
+        voicevol[0] = (SBEMU_GetMixerReg(SBEMU_MIXERREG_VOICESTEREO)>>4)*256/15;
+        voicevol[1] = (SBEMU_GetMixerReg(SBEMU_MIXERREG_VOICESTEREO)&0xF)*256/15;
+        midivol[0] = (SBEMU_GetMixerReg(SBEMU_MIXERREG_MIDISTEREO)>>4)*256/15;
+        midivol[1] = (SBEMU_GetMixerReg(SBEMU_MIXERREG_MIDISTEREO)&0xF)*256/15;
+    }
+    else //SBPro
+    {
+        vol[0] = (SBEMU_GetMixerReg(SBEMU_MIXERREG_MASTERSTEREO)>>5)*256/7; //3:1:3:1
+        vol[1] = ((SBEMU_GetMixerReg(SBEMU_MIXERREG_MASTERSTEREO)>>1)&0x7)*256/7;
+        voicevol[0] = (SBEMU_GetMixerReg(SBEMU_MIXERREG_VOICESTEREO)>>5)*256/7;
+        voicevol[1] = ((SBEMU_GetMixerReg(SBEMU_MIXERREG_VOICESTEREO)>>1)&0x7)*256/7;
+        midivol[0] = (SBEMU_GetMixerReg(SBEMU_MIXERREG_MIDISTEREO)>>5)*256/7;
+        midivol[1] = ((SBEMU_GetMixerReg(SBEMU_MIXERREG_MIDISTEREO)>>1)&0x7)*256/7;
+    }
+    //_LOG("vol: %d, voicevol: %d, midivol: %d\n", vol[0], voicevol[0], midivol[0]);
+    if(MAIN_Options[OPT_HWMIXER].value)
+    { //louder channel of master (and voice if it's the only source) goes to the card mixer, only the balance stays in software
+        BOOL fmsilent = !MAIN_Options[OPT_OPL].value || (midivol[0] == 0 && midivol[1] == 0);
+        int32_t master = max(vol[0], vol[1]);
+        int32_t voice = fmsilent ? max(voicevol[0], voicevol[1]) : 256;
+        for(int ch = 0; ch < 2; ++ch)
+        {
+            vol[ch] = master ? vol[ch]*256/master : 0;
+            voicevol[ch] = voice ? voicevol[ch]*256/voice : 0;
+        }
+        int hwvol = MAIN_Options[OPT_VOL].value*100/9 * master/256 * voice/256;
+        if(hwvol != MAIN_HWVolume)
+        {
+            MAIN_HWVolume = hwvol;
+            MAIN_HWVolumeDirty = TRUE; //applied in interrupt, the only place touching the card
+        }
+    }
+    MAIN_Pipe.LinearMix = MAIN_Options[OPT_LINEARMIX].value;
+    for(int ch = 0; ch < 2; ++ch)
+    {
+        int32_t voice = voicevol[ch]*vol[ch]*(1<<CV_MIX_GAIN_SHIFT)/(256*256);
+        int32_t midi = midivol[ch]*vol[ch]*(1<<CV_MIX_GAIN_SHIFT)/(256*256);
+        MAIN_Pipe.GainVoice[ch*2] = (int16_t)voice;
+        MAIN_Pipe.GainMidi[ch*2] = (int16_t)midi;
+        MAIN_Pipe.GainVoice[ch*2+1] = MAIN_Pipe.GainMidi[ch*2+1] = 0;
+        if(MAIN_Pipe.LinearMix)
+        {
+            MAIN_Pipe.GainMix[ch*2] = (int16_t)voice;
+            MAIN_Pipe.GainMix[ch*2+1] = (int16_t)(midi*(MAIN_DOUBLE_OPL_VOLUME+1));
+        }
+        else //master applied after the curve
+        {
+            MAIN_Pipe.GainMix[ch*2] = (int16_t)(voicevol[ch]*(1<<CV_MIX_GAIN_SHIFT)/256);
+            MAIN_Pipe.GainMix[ch*2+1] = (int16_t)(midivol[ch]*(1<<CV_MIX_GAIN_SHIFT)/256*(MAIN_DOUBLE_OPL_VOLUME+1));
+            MAIN_Pipe.GainMaster[ch] = (int16_t)(vol[ch]*(1<<CV_MIX_GAIN_SHIFT)/256);
+        }
+    }
+}
+
+//retune the card without AU_close/AU_init. exact: bypass driver's preferred rates (i.e. HDA >= 44100), still snapped to supported ones
+static void MAIN_SetCardRate(int samplerate, BOOL exact)
+{
+    mpxplay_audio_decoder_info_s adi = {NULL, 0, 1, samplerate, SBEMU_CHANNELS, SBEMU_CHANNELS, NULL, SBEMU_BITS, SBEMU_BITS/8, 0};
+    int oldrate = aui.freq_card;
+    aui.freq_set = exact ? samplerate : 0;
+    AU_setrate(&aui, &adi);
+    aui.freq_set = 0;
+    if(aui.freq_card != oldrate && MAIN_Options[OPT_OPL].value)
+        OPL3EMU_SetRate(aui.freq_card);
+    AU_prestart(&aui); //setsamplerate/reset will do stop
+    AU_start(&aui);
+}
+
+static BOOL MAIN_FollowHasFailed(int samplerate)
+{
+    for(int i = 0; i < min(MAIN_FollowFailedCount, MAIN_FOLLOW_FAILED_MAX); ++i)
+    {
+        if(MAIN_FollowFailed[i] == samplerate)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+//called from ISR with the rate of a running transfer: run the card at the guest rate so it needs no resampling.
+//retune only after the rate lasts a few interrupts, short sound effects at other rates are resampled as usual.
+//the card is not reprogrammed in its own ISR, the retune is left to the timer interrupt (MAIN_FollowRetune).
+static void MAIN_FollowRate(int samplerate)
+{
+    if(samplerate < MAIN_MIN_RATE || samplerate > MAIN_FOLLOW_MAX_RATE
+    || (MAIN_Options[OPT_OPL].value && samplerate < MAIN_FOLLOW_MIN_OPL_RATE-MAIN_RATE_TOLERANCE)
+    || abs(samplerate - aui.freq_card) <= MAIN_RATE_TOLERANCE || MAIN_FollowHasFailed(samplerate) || MAIN_FollowPending)
+    {
+        MAIN_FollowCount = 0;
+        return;
+    }
+    if(samplerate != MAIN_FollowCandidate)
+    {
+        MAIN_FollowCandidate = samplerate;
+        MAIN_FollowCount = 0;
+    }
+    if(++MAIN_FollowCount < MAIN_FOLLOW_HOLD)
+        return;
+    MAIN_FollowCount = 0;
+    MAIN_FollowPending = samplerate;
+}
+
+//retune the card to the pending guest rate, from timer interrupt with the card IRQ masked
+static void MAIN_FollowRetune()
+{
+    int samplerate = MAIN_FollowPending;
+    //prefer standard rates: time constant rates (i.e. 22222) are not exact, fixed rate codecs only support standard ones
+    static const int rates[] = {8000, 11025, 16000, 22050, 32000, 44100, 48000};
+    int rate = samplerate;
+    for(int i = 0; i < countof(rates); ++i)
+    {
+        if(abs(samplerate - rates[i]) <= MAIN_RATE_TOLERANCE)
+            rate = rates[i];
+    }
+    PIC_MaskIRQ(aui.card_irq);
+    static char fpustate[108]; //driver and OPL setup use FPU
+    #ifdef DJGPP
+    asm("fsave %0\n\t finit":"=m"(fpustate));
+    #endif
+    MAIN_SetCardRate(rate, TRUE);
+    if(abs(samplerate - aui.freq_card) > MAIN_RATE_TOLERANCE) //not supported, back to configured rate
+    {
+        _LOG("follow rate %d failed: %d\n", samplerate, aui.freq_card);
+        MAIN_FollowFailed[MAIN_FollowFailedCount++ % MAIN_FOLLOW_FAILED_MAX] = samplerate;
+        MAIN_SetCardRate(MAIN_BCD2Int(MAIN_Options[OPT_RATE].value), FALSE);
+    }
+    #ifdef DJGPP
+    asm("frstor %0" ::"m"(fpustate));
+    #endif
+    MAIN_FollowPending = 0;
+    PIC_UnmaskIRQ(aui.card_irq);
+    _LOG("follow rate: %d %d\n", samplerate, aui.freq_card);
+}
+
+//end of DSP block in pipeline
+static void MAIN_RaiseIRQ()
+{
+    MAIN_InvokeIRQ(SBEMU_GetIRQ(), &MAIN_IntContext);
+}
+
 static void MAIN_Interrupt()
 {
     #if 0
@@ -696,215 +1093,123 @@ static void MAIN_Interrupt()
     #else
     if(!(aui.card_infobits&AUINFOS_CARDINFOBIT_PLAYING))
         return;
-        
-    if(SBEMU_IRQTriggered())
-    {
-        MAIN_InvokeIRQ(SBEMU_GetIRQ());
-        SBEMU_SetIRQTriggered(FALSE);
-    }
-    int32_t vol;
-    int32_t voicevol;
-    int32_t midivol;
-    if(MAIN_Options[OPT_TYPE].value == 1 || MAIN_Options[OPT_TYPE].value == 3) //SB2.0 and before
-    {
-        vol = (SBEMU_GetMixerReg(SBEMU_MIXERREG_MASTERVOL) >> 1)*256/7;
-        voicevol = (SBEMU_GetMixerReg(SBEMU_MIXERREG_VOICEVOL) >> 1)*256/3;
-        midivol = (SBEMU_GetMixerReg(SBEMU_MIXERREG_MIDIVOL) >> 1)*256/7;
-    }
-    else if(MAIN_Options[OPT_TYPE].value == 6) //SB16
-    {
-        vol = (SBEMU_GetMixerReg(SBEMU_MIXERREG_MASTERSTEREO)>>4)*256/15; //4:4
-        voicevol = (SBEMU_GetMixerReg(SBEMU_MIXERREG_VOICESTEREO)>>4)*256/15; //4:4
-        midivol = (SBEMU_GetMixerReg(SBEMU_MIXERREG_MIDISTEREO)>>4)*256/15; //4:4
-        //_LOG("vol: %d, voicevol: %d, midivol: %d\n", vol, voicevol, midivol);
-    }
-    else //SBPro
+    if(MAIN_Options[OPT_FOLLOW].value && SBEMU_HasStarted())
+        MAIN_FollowRate(SBEMU_GetSampleRate());
+    if(MAIN_HWVolumeDirty)
     {
-        vol = (SBEMU_GetMixerReg(SBEMU_MIXERREG_MASTERSTEREO)>>5)*256/7; //3:1:3:1 stereo usually the same for both channel for games?;
-        voicevol = (SBEMU_GetMixerReg(SBEMU_MIXERREG_VOICESTEREO)>>5)*256/7; //3:1:3:1
-        midivol = (SBEMU_GetMixerReg(SBEMU_MIXERREG_MIDISTEREO)>>5)*256/7;
-        //_LOG("vol: %d, voicevol: %d, midivol: %d\n", vol, voicevol, midivol);
+        static char fpustate[108]; //mixer value conversion uses FPU
+        #ifdef DJGPP
+        asm("fsave %0\n\t finit":"=m"(fpustate));
+        #endif
+        AU_setmixer_one(&aui, AU_MIXCHAN_MASTER, MIXER_SETMODE_ABSOLUTE, MAIN_HWVolume);
+        #ifdef DJGPP
+        asm("frstor %0" ::"m"(fpustate));
+        #endif
+        MAIN_HWVolumeDirty = FALSE;
     }
-
+        
+    if(SBEMU_ServiceEvents(MAIN_TSCPerUS ? PLTFM_RDTSC() : 0))
+        MAIN_InvokeIRQ(SBEMU_GetIRQ(), &MAIN_IntContext);
     aui.card_outbytes = aui.card_dmasize;
     int samples = AU_cardbuf_space(&aui) / sizeof(int16_t) / 2; //16 bit, 2 channels
     //_LOG("samples:%d\n",samples);
-    if(samples == 0)
+    if(samples == 0 || MAIN_Pipe.SBPCM == NULL)
         return;
-    
-    BOOL digital = SBEMU_HasStarted();
-    int dma = (SBEMU_GetBits() <= 8 || MAIN_Options[OPT_TYPE].value < 6) ? SBEMU_GetDMA() : SBEMU_GetHDMA();
-    int32_t DMA_Count = VDMA_GetCounter(dma); //count in bytes
-    if(digital)//&& DMA_Count != 0x10000) //-1(0xFFFF)+1=0
-    {
-        uint32_t DMA_Addr = VDMA_GetAddress(dma);
-        int32_t DMA_Index = VDMA_GetIndex(dma);
-        uint32_t SB_Bytes = SBEMU_GetSampleBytes();
-        uint32_t SB_Pos = SBEMU_GetPos();
-        uint32_t SB_Rate = SBEMU_GetSampleRate();
-        int samplesize = max(1, SBEMU_GetBits()/8); //sample size in bytes 1 for 8bit. 2 for 16bit
-        int channels = SBEMU_GetChannels();
-        _LOG("sample rate: %d %d\n", SB_Rate, aui.freq_card);
-        _LOG("channels: %d, size:%d\n", channels, samplesize);
-        //_LOG("DMA index: %x\n", DMA_Index);
-        //_LOG("digital start\n");
-        int pos = 0;
-        do {
-            if(MAIN_DMA_MappedAddr != 0
-             && !(DMA_Addr >= MAIN_DMA_Addr && DMA_Addr+DMA_Index+DMA_Count <= MAIN_DMA_Addr+MAIN_DMA_Size))
-            {
-                if(MAIN_DMA_MappedAddr > 1024*1024)
-                    DPMI_UnmappMemory(MAIN_DMA_MappedAddr);
-                MAIN_DMA_MappedAddr = 0;
-            }
-            if(MAIN_DMA_MappedAddr == 0)
-            {
-                MAIN_DMA_Addr = DMA_Addr&~0xFFF;
-                MAIN_DMA_Size = align(max(DMA_Addr-MAIN_DMA_Addr+DMA_Index+DMA_Count, 64*1024*2), 4096);
-                MAIN_DMA_MappedAddr = (DMA_Addr+DMA_Index+DMA_Count <= 1024*1024) ? (DMA_Addr&~0xFFF) : DPMI_MapMemory(MAIN_DMA_Addr, MAIN_DMA_Size);
-            }
-            //_LOG("DMA_ADDR:%x, %x, %x\n",DMA_Addr, MAIN_DMA_Addr, MAIN_DMA_MappedAddr);
-
-            int count = samples-pos;
-            BOOL resample = TRUE; //don't resample if sample rates are close
-            if(SB_Rate < aui.freq_card-50)
-                count = max(1, count*SB_Rate/aui.freq_card);
-            else if(SB_Rate > aui.freq_card+50)
-                count = count*SB_Rate/aui.freq_card;
-            else
-                resample = FALSE;
-            count = min(count, max(1,(DMA_Count)/samplesize/channels)); //max for stereo initial 1 byte
-            count = min(count, max(1,(SB_Bytes-SB_Pos)/samplesize/channels)); //max for stereo initial 1 byte. 1/2channel = 0, make it 1
-            if(SBEMU_GetBits()<8) //ADPCM 8bit
-                count = max(1, count / (9 / SBEMU_GetBits()));
-            _LOG("samples:%d %d %d, %d %d, %d %d\n", samples, pos+count, count, DMA_Count, DMA_Index, SB_Bytes, SB_Pos);
-            int bytes = count * samplesize * channels;
-
-            if(MAIN_DMA_MappedAddr == 0) //map failed?
-                memset(MAIN_PCM+pos*2, 0, bytes);
-            else
-                DPMI_CopyLinear(DPMI_PTR2L(MAIN_PCM+pos*2), MAIN_DMA_MappedAddr+(DMA_Addr-MAIN_DMA_Addr)+DMA_Index, bytes);
-            if(SBEMU_GetBits()<8) //ADPCM  8bit
-                count = SBEMU_DecodeADPCM((uint8_t*)(MAIN_PCM+pos*2), bytes);
-            if(samplesize != 2)
-                cv_bits_n_to_m(MAIN_PCM+pos*2, count*channels, samplesize, 2);
-            if(resample/*SB_Rate != aui.freq_card*/)
-                count = mixer_speed_lq(MAIN_PCM+pos*2, count*channels, channels, SB_Rate, aui.freq_card)/channels;
-            if(channels == 1) //should be the last step
-                cv_channels_1_to_n(MAIN_PCM+pos*2, count, 2, 2);
-            pos += count;
-            //_LOG("samples:%d %d %d\n", count, pos, samples);
-            DMA_Index = VDMA_SetIndexCounter(dma, DMA_Index+bytes, DMA_Count-bytes);
-            DMA_Count = VDMA_GetCounter(dma);
-            SB_Pos = SBEMU_SetPos(SB_Pos+bytes);
-            //_LOG("SB bytes: %d %d\n", SB_Pos, SB_Bytes);
-            if(SB_Pos >= SB_Bytes)
-            {
-                //_LOG("INT:%d,%d,%d,%d\n",MAIN_SBBytes,SBEMU_GetSampleBytes(),MAIN_DMAIndex,DMA_Count);
-                //_LOG("SBEMU: Auto: %d\n",SBEMU_GetAuto());
-                if(!SBEMU_GetAuto())
-                    SBEMU_Stop();
-                SB_Pos = SBEMU_SetPos(0);
-                
-                MAIN_InvokeIRQ(SBEMU_GetIRQ());
-                if(SB_Bytes <= 32) //detection routine?
-                {
-                    int c = SBEMU_GetDetectionCounter();
-                    if(++c >= 256) //Miles Sound will "freeze" or crash when we continually send virtual interrupt to it, it seems it processes slow and virtual interrupt keeps happening until crash.
-                        SBEMU_Stop(); //fix problem when Miles Sound using SB driver on SBPro emulation
-                    SBEMU_SetDetectionCounter(c);
-                    break; //fix crash in virtualbox.
-                }
-                
-                SB_Bytes = SBEMU_GetSampleBytes();
-                SB_Pos = SBEMU_GetPos();
-                SB_Rate = SBEMU_GetSampleRate();
-                //incase IRQ handler re-programs DMA
-                DMA_Index = VDMA_GetIndex(dma);
-                DMA_Count = VDMA_GetCounter(dma);
-                DMA_Addr = VDMA_GetAddress(dma);
-                //_LOG("DMACount: %d, DMAIndex:%d, DMA_Addr:%x\n",DMA_Count, DMA_Index, DMA_Addr);
-            }
-        } while(VDMA_GetAuto(dma) && (pos < samples) && SBEMU_HasStarted());
-        //_LOG("digital end %d %d\n", samples, pos);
-        //for(int i = pos; i < samples; ++i)
-        //    MAIN_PCM[i*2+1] = MAIN_PCM[i*2] = 0;
-        samples = min(samples, pos);
+
+    MAIN_ArenaUsed = MAIN_ArenaMark; //drop buffers of last interrupt
+    int pcmframes = samples + 128;
+    BOOL opl = MAIN_Options[OPT_OPL].value;
+    MAIN_Pipe.PCM = (int16_t*)MAIN_ArenaAlloc(pcmframes*2*sizeof(int16_t));
+    MAIN_Pipe.OPLPCM = opl ? (int16_t*)MAIN_ArenaAlloc(pcmframes*2*sizeof(int16_t)) : NULL;
+    MAIN_Pipe.PCM_Frames = pcmframes;
+    MAIN_Pipe.DMABUF = (uint8_t*)MAIN_ArenaAlloc(MAIN_DMABUF_Size);
+    if(MAIN_Pipe.PCM == NULL || MAIN_Pipe.DMABUF == NULL || (opl && MAIN_Pipe.OPLPCM == NULL)) //should not happen, arena sized for whole card buffer
+        return;
+    MAIN_Pipe.CardRate = aui.freq_card;
+    MAIN_Pipe.CardSamplesPerInt = aui.card_samples_per_int;
+    MAIN_Pipe.OPL = opl;
+    MAIN_Pipe.HighDMA = MAIN_Options[OPT_TYPE].value >= 6;
+    MAIN_Pipe.NearLinear = MAIN_NearLinear;
+
+    BOOL digital;
+    samples = PIPELINE_Render(&MAIN_Pipe, samples, &digital);
+    samples *= 2; //to stereo
+
+    char* span1;
+    char* span2;
+    unsigned int len1, len2;
+    if(AU_cardbuf_getspans(&aui, samples*sizeof(int16_t), &span1, &len1, &span2, &len2) == samples*sizeof(int16_t))
+    { //zero-copy: final mix goes straight into the card DMA buffer
+        PIPELINE_Mix(&MAIN_Pipe, (int16_t*)span1, 0, len1/sizeof(int16_t), digital);
+        PIPELINE_Mix(&MAIN_Pipe, (int16_t*)span2, len1/sizeof(int16_t), len2/sizeof(int16_t), digital);
+        AU_cardbuf_commit(&aui, samples*sizeof(int16_t));
     }
-    else if(SBEMU_GetDirectCount()>=3)
+    else
     {
-        samples = SBEMU_GetDirectCount();
-        _LOG("direct out:%d %d\n",samples,aui.card_samples_per_int);
-        memcpy(MAIN_PCM, SBEMU_GetDirectPCM8(), samples);
-        SBEMU_ResetDirect();
-        #if 1 //fix noise for some games
-        int zeros = TRUE;
-        for(int i = 0; i < samples && zeros; ++i)
-        {
-            if(((uint8_t*)MAIN_PCM)[i] != 0)
-                zeros = FALSE;
-        }
-        if(zeros)
-        {
-            for(int i = 0; i < samples; ++i)
-                ((uint8_t*)MAIN_PCM)[i] = 128;
-        }
-        #endif
-        //for(int i = 0; i < samples; ++i) _LOG("%d ",((uint8_t*)MAIN_PCM)[i]); _LOG("\n");
-        cv_bits_n_to_m(MAIN_PCM, samples, 1, 2);
-        //for(int i = 0; i < samples; ++i) _LOG("%d ",MAIN_PCM[i]); _LOG("\n");
-        const int interrupt_frequency = aui.freq_card/aui.card_samples_per_int;
-        samples = mixer_speed_lq(MAIN_PCM, samples, 1, (samples-1)*interrupt_frequency, aui.freq_card);
-        //for(int i = 0; i < samples; ++i) _LOG("%d ",MAIN_PCM[i]); _LOG("\n");
-        cv_channels_1_to_n(MAIN_PCM, samples, 2, 2);
-        digital = TRUE;
+        PIPELINE_Mix(&MAIN_Pipe, MAIN_Pipe.PCM, 0, samples, digital);
+        aui.samplenum = samples;
+        aui.pcm_sample = MAIN_Pipe.PCM;
+        AU_writedata(&aui);
     }
-    else if(!MAIN_Options[OPT_OPL].value)
-        memset(MAIN_PCM, 0, samples*sizeof(int16_t)*2); //output muted samples.
-
-    if(MAIN_Options[OPT_OPL].value)
+    #if MAIN_PROFILE
+    MAIN_ProfileFrames += samples/2;
+    if(++MAIN_ProfileInts >= MAIN_PROFILE_INTERVAL)
     {
-        int16_t* pcm = digital ? MAIN_OPLPCM : MAIN_PCM;
-        OPL3EMU_GenSamples(pcm, samples); //will generate samples*2 if stereo
-        //always use 2 channels
-        int channels = OPL3EMU_GetMode() ? 2 : 1;
-        if(channels == 1)
-            cv_channels_1_to_n(pcm, samples, 2, SBEMU_BITS/8);
-
-        if(digital)
+        _LOG("profile: %d frames at %d Hz, cycles/frame:", MAIN_ProfileFrames, aui.freq_card);
+        for(int i = 0; i < PIPELINE_STAGES; ++i)
         {
-            for(int i = 0; i < samples*2; ++i)
-            {
-                #if 1
-                // https://stackoverflow.com/questions/12089662/mixing-16-bit-linear-pcm-streams-and-avoiding-clipping-overflow
-                int a = (int)(MAIN_PCM[i] * voicevol/256) + 32768;
-                int b = (int)(MAIN_OPLPCM[i] * midivol/256 * (MAIN_DOUBLE_OPL_VOLUME+1)) + 32768;
-                int mixed = (a < 32768 || b < 32768) ? (a*b/32768) : ((a+b)*2 - a*b/32768 - 65536);
-                if(mixed == 65536) mixed = 65535;
-                MAIN_PCM[i] = (mixed - 32768) * vol/256;
-                #else //simple average: sounds the same as DOSBox
-                int a = (int)(MAIN_PCM[i] * voicevol/256);
-                int b = (int)(MAIN_OPLPCM[i] * midivol/256);
-                MAIN_PCM[i] = (a+b)/2 * vol/256;
-                #endif
-            }
+            _LOG(" %s %d", MAIN_ProfileNames[i], MAIN_ProfileFrames ? (int)(MAIN_ProfileCycles[i]/MAIN_ProfileFrames) : 0);
+            MAIN_ProfileCycles[i] = 0;
         }
-        else for(int i = 0; i < samples*2; ++i)
-            MAIN_PCM[i] = MAIN_PCM[i] * midivol/256 * vol/256;
+        _LOG("\n");
+        MAIN_ProfileFrames = MAIN_ProfileInts = 0;
     }
-    else if(digital)
-        for(int i = 0; i < samples*2; ++i)
-            MAIN_PCM[i] = MAIN_PCM[i] * voicevol/256 * vol/256;
-    samples *= 2; //to stereo
-
-    aui.samplenum = samples;
-    aui.pcm_sample = MAIN_PCM;
-    AU_writedata(&aui);
+    #endif
 
     //_LOG("MAIN INT END\n");
     #endif
 }
 
+static void MAIN_TSR_DumpTrapStats(int id)
+{
+    DPMI_REG r = {0};
+    r.h.ah = id;
+    r.h.al = 0x03; //get trap statistics
+    DPMI_CallRealModeINT(MAIN_TSR_INT, &r);
+    uint8_t types = r.h.dl;
+    printf("QEMM callback access types seen: %02x%s\n", types, (types&(QEMM_IOTYPE_STRING|QEMM_IOTYPE_REP)) ? " (string I/O flagged)" : "");
+    if(r.d.ebx == 0)
+    {
+        r.h.ah = id;
+        r.h.al = 0x04; //reset
+        DPMI_CallRealModeINT(MAIN_TSR_INT, &r);
+        printf("I/O trap statistics not available (built without QEMM_TRAP_STATS).\n");
+        return;
+    }
+    int count = r.d.ecx;
+    QEMM_TRAPSTAT* stats = (QEMM_TRAPSTAT*)malloc(sizeof(QEMM_TRAPSTAT)*count);
+    DPMI_CopyLinear(DPMI_PTR2L(stats), r.d.ebx, sizeof(QEMM_TRAPSTAT)*count);
+    r.h.ah = id;
+    r.h.al = 0x04; //reset
+    DPMI_CallRealModeINT(MAIN_TSR_INT, &r);
+
+    uint32_t hits = 0;
+    uint64_t cycles = 0;
+    printf("Port        In       Out        Cycles  Cycles/trap\n");
+    for(int port = 0; port < count; ++port)
+    {
+        QEMM_TRAPSTAT* stat = &stats[port];
+        uint32_t n = stat->In + stat->Out;
+        if(n == 0)
+            continue;
+        printf("%03x  %9lu %9lu %13llu %12llu\n", port, (unsigned long)stat->In, (unsigned long)stat->Out, (unsigned long long)stat->Cycles, (unsigned long long)(stat->Cycles / n));
+        hits += n;
+        cycles += stat->Cycles;
+    }
+    printf("Total %lu traps, %llu cycles. Counters reset.\n", (unsigned long)hits, (unsigned long long)cycles);
+    free(stats);
+}
+
 void MAIN_TSR_InstallationCheck()
 {
     for(int i = MAIN_TSR_INTSTART_ID; i <= 0xFF; ++i)
@@ -918,6 +1223,11 @@ void MAIN_TSR_InstallationCheck()
         if(DPMI_CompareLinear(DPMI_SEGOFF2L(r.w.dx, r.w.di), DPMI_PTR2L((char*)MAIN_ISR_DOSID_String), 16) == 0)
         {
             printf("SBEMU is active.\n");
+            if(MAIN_Options[OPT_STAT].value)
+            {
+                MAIN_TSR_DumpTrapStats(i);
+                exit(0);
+            }
 
             r.h.ah = i;
             r.h.al = 0x01; //get current settings
@@ -950,6 +1260,7 @@ void MAIN_TSR_InstallationCheck()
             r.h.al = 0x01; //read back to confirm
             DPMI_CallRealModeINT(MAIN_TSR_INT, &r);
             DPMI_CopyLinear(DPMI_PTR2L(opt), r.d.ebx, sizeof(MAIN_Options));
+            _LOG("ISR buffers: peak %d of %d bytes\n", r.d.ecx, r.d.edx);
             printf("Current settings:\n");
             for(int i = OPT_Help+1; i < OPT_COUNT; ++i)
             {
@@ -983,8 +1294,20 @@ static void MAIN_TSR_Interrupt()
         case 0x01: //query
         {
             MAIN_TSRREG.d.ebx = DPMI_PTR2L(MAIN_Options);
+            MAIN_TSRREG.d.ecx = MAIN_ArenaPeak; //ISR buffer statistics
+            MAIN_TSRREG.d.edx = MAIN_ArenaSize;
         }
         return;
+        case 0x03: //trap statistics: ebx=linear address of QEMM_TRAPSTAT array (0: not available), ecx=count, dl=QEMM callback access types
+        {
+            MAIN_TSRREG.d.ebx = QEMM_GetTrapStats();
+            MAIN_TSRREG.d.ecx = MAIN_TSRREG.d.ebx ? QEMM_DISPATCH_PORTS : 0;
+            MAIN_TSRREG.h.dl = QEMM_GetTrapTypes();
+        }
+        return;
+        case 0x04: //reset trap statistics & access types
+            QEMM_ResetTrapStats();
+        return;
         case 0x02: //set
         {
             struct MAIN_OPT* opt = (struct MAIN_OPT*)malloc(sizeof(MAIN_Options));
@@ -996,7 +1319,8 @@ static void MAIN_TSR_Interrupt()
             #endif
             int irq = aui.card_irq;
             PIC_MaskIRQ(irq);
-            if(MAIN_Options[OPT_OUTPUT].value != opt[OPT_OUTPUT].value || MAIN_Options[OPT_RATE].value != opt[OPT_RATE].value || opt[OPT_RESET].value)
+            MAIN_FollowPending = 0; //no retune from timer interrupt meanwhile: only set by card ISR
+            if(MAIN_Options[OPT_OUTPUT].value != opt[OPT_OUTPUT].value || MAIN_Options[OPT_RATE].value != opt[OPT_RATE].value || MAIN_Options[OPT_FOLLOW].value != opt[OPT_FOLLOW].value || opt[OPT_RESET].value)
             {
                 if(opt[OPT_OUTPUT].value != MAIN_Options[OPT_OUTPUT].value || opt[OPT_RESET].value)
                 {
@@ -1015,21 +1339,40 @@ static void MAIN_TSR_Interrupt()
                 _LOG("Change sample rate\n");
                 _LOG("FLAGS:%x\n",CPU_FLAGS());
 
-                int samplerate = (opt[OPT_RATE].value == 0x22050) ? 22050 : 44100;
-                mpxplay_audio_decoder_info_s adi = {NULL, 0, 1, samplerate, SBEMU_CHANNELS, SBEMU_CHANNELS, NULL, SBEMU_BITS, SBEMU_BITS/8, 0};
-                AU_setrate(&aui, &adi);
-                if(MAIN_Options[OPT_RATE].value != opt[OPT_RATE].value)
-                    OPL3EMU_Init(aui.freq_card);
-                AU_prestart(&aui); //setsamplerate/reset will do stop
-                AU_start(&aui);
-                MAIN_Options[OPT_RATE].value = opt[OPT_RATE].value;
+                int samplerate = MAIN_BCD2Int(opt[OPT_RATE].value);
+                if(samplerate < MAIN_MIN_RATE || samplerate > MAIN_MAX_RATE)
+                    samplerate = MAIN_BCD2Int(MAIN_Options[OPT_RATE].value);
+                MAIN_Options[OPT_FOLLOW].value = opt[OPT_FOLLOW].value;
+                MAIN_FollowFailedCount = MAIN_FollowCount = 0;
+                MAIN_SetCardRate(samplerate, FALSE);
+                MAIN_ArenaInit(); //card buffer may change
+                MAIN_Options[OPT_RATE].value = MAIN_Int2BCD(aui.freq_card); //actual rate of the card, read back by caller
             }
             if(MAIN_Options[OPT_VOL].value != opt[OPT_VOL].value)
             {
                 _LOG("Reset volume\n");
                 MAIN_Options[OPT_VOL].value = opt[OPT_VOL].value;
                 AU_setmixer_one(&aui, AU_MIXCHAN_MASTER, MIXER_SETMODE_ABSOLUTE, MAIN_Options[OPT_VOL].value*100/9);
+                MAIN_HWVolume = -1; //card mixer rewritten, re-apply SB volume
             }
+            if(MAIN_Options[OPT_HWMIXER].value != opt[OPT_HWMIXER].value || MAIN_Options[OPT_LINEARMIX].value != opt[OPT_LINEARMIX].value || MAIN_HWVolume < 0)
+            {
+                MAIN_Options[OPT_HWMIXER].value = opt[OPT_HWMIXER].value;
+                MAIN_Options[OPT_LINEARMIX].value = opt[OPT_LINEARMIX].value;
+                if(!MAIN_Options[OPT_HWMIXER].value && MAIN_HWVolume >= 0) //back to software volume
+                    AU_setmixer_one(&aui, AU_MIXCHAN_MASTER, MIXER_SETMODE_ABSOLUTE, MAIN_Options[OPT_VOL].value*100/9);
+                MAIN_HWVolume = -1;
+                MAIN_UpdateGains();
+            }
+            if(MAIN_Options[OPT_QUALITY].value != opt[OPT_QUALITY].value)
+            {
+                _LOG("Change resampling quality\n");
+                MAIN_Options[OPT_QUALITY].value = opt[OPT_QUALITY].value;
+                mixer_speed_stream_setsinc(&MAIN_Pipe.Resampler, MAIN_Options[OPT_QUALITY].value);
+                mixer_speed_stream_setsinc(&MAIN_Pipe.DirectResampler, MAIN_Options[OPT_QUALITY].value);
+            }
+            if(MAIN_Options[OPT_WSPOLICY].value != opt[OPT_WSPOLICY].value)
+                MAIN_Options[OPT_WSPOLICY].value = MAIN_SetWSPolicy(opt[OPT_WSPOLICY].value); //actual mode, read back by caller
             #ifdef DJGPP //make vscode happy
             asm("frstor %0" ::"m"(*fpustate));
             #endif
@@ -1064,55 +1407,42 @@ static void MAIN_TSR_Interrupt()
                 return;
             }
             
-            //re-install all
-            if(MAIN_Options[OPT_RM].value)
-            {
-                _LOG("uninstall qemm\n");
-                if(MAIN_Options[OPT_OPL].value) QEMM_Uninstall_IOPortTrap(&OPL3IOPT);
-                QEMM_Uninstall_IOPortTrap(&MAIN_VDMA_IOPT);
-                #if !MAIN_TRAP_PIC_ONDEMAND
-                QEMM_Uninstall_IOPortTrap(&MAIN_VIRQ_IOPT);
-                #endif
-                QEMM_Uninstall_IOPortTrap(&MAIN_SB_IOPT);
-            }
-            if(MAIN_Options[OPT_PM].value)
-            {
-                _LOG("uninstall hdpmi\n");
-                if(MAIN_Options[OPT_OPL].value) HDPMIPT_Uninstall_IOPortTrap(&OPL3IOPT_PM);
-                HDPMIPT_Uninstall_IOPortTrap(&MAIN_VDMA_IOPT_PM1);
-                HDPMIPT_Uninstall_IOPortTrap(&MAIN_VDMA_IOPT_PM2);
-                HDPMIPT_Uninstall_IOPortTrap(&MAIN_VDMA_IOPT_PM3);
-                HDPMIPT_Uninstall_IOPortTrap(&MAIN_VHDMA_IOPT_PM1);
-                HDPMIPT_Uninstall_IOPortTrap(&MAIN_VHDMA_IOPT_PM2);
-                HDPMIPT_Uninstall_IOPortTrap(&MAIN_VHDMA_IOPT_PM3);
-                #if !MAIN_TRAP_PIC_ONDEMAND
-                HDPMIPT_Uninstall_IOPortTrap(&MAIN_VIRQ_IOPT_PM1);
-                HDPMIPT_Uninstall_IOPortTrap(&MAIN_VIRQ_IOPT_PM2);
-                #endif
-                HDPMIPT_Uninstall_IOPortTrap(&MAIN_SB_IOPT_PM);
-            }
             opt[OPT_PM].value = opt[OPT_PM].value && MAIN_HDPMI_Present;
             opt[OPT_RM].value = opt[OPT_RM].value && MAIN_QEMM_Present;
 
-            if(opt[OPT_OPL].value)
-            {
-                _LOG("install opl\n");
-                if(opt[OPT_RM].value) QEMM_Install_IOPortTrap(MAIN_OPL3IODT, 4, &OPL3IOPT);
-                if(opt[OPT_PM].value) HDPMIPT_Install_IOPortTrap(0x388, 0x38B, MAIN_OPL3IODT, 4, &OPL3IOPT_PM);
-            }
-
             QEMM_IODT* SB_Iodt = opt[OPT_OPL].value ? MAIN_SB_IODT : MAIN_SB_IODT+4;
             int SB_IodtCount = opt[OPT_OPL].value ? countof(MAIN_SB_IODT) : countof(MAIN_SB_IODT)-4;
             if(opt[OPT_ADDR].value != MAIN_Options[OPT_ADDR].value)
             {
                 for(int i = 0; i < countof(MAIN_SB_IODT); ++i)
                     MAIN_SB_IODT[i].port = MAIN_SB_IODT[i].port - MAIN_Options[OPT_ADDR].value + opt[OPT_ADDR].value;
-                MAIN_Options[OPT_ADDR].value = opt[OPT_ADDR].value;
             }
+            BOOL OPLOn = opt[OPT_OPL].value && !MAIN_Options[OPT_OPL].value;
+            BOOL OPLOff = !opt[OPT_OPL].value && MAIN_Options[OPT_OPL].value;
 
-            if(opt[OPT_RM].value)
+            //swap sets in place if a trap interface stays enabled: ports in both old & new sets keep trapped
+            if(MAIN_Options[OPT_RM].value && opt[OPT_RM].value)
+            {
+                _LOG("swap qemm\n");
+                if(OPLOn) QEMM_Install_IOPortTrap(MAIN_OPL3IODT, 4, &OPL3IOPT);
+                if(!QEMM_Swap_IOPortTrap(&MAIN_SB_IOPT, SB_Iodt, SB_IodtCount))
+                    _LOG("swap qemm failed, previous ports kept\n");
+                if(OPLOff) QEMM_Uninstall_IOPortTrap(&OPL3IOPT);
+            }
+            else if(MAIN_Options[OPT_RM].value)
+            {
+                _LOG("uninstall qemm\n");
+                if(MAIN_Options[OPT_OPL].value) QEMM_Uninstall_IOPortTrap(&OPL3IOPT);
+                QEMM_Uninstall_IOPortTrap(&MAIN_VDMA_IOPT);
+                #if !MAIN_TRAP_PIC_ONDEMAND
+                QEMM_Uninstall_IOPortTrap(&MAIN_VIRQ_IOPT);
+                #endif
+                QEMM_Uninstall_IOPortTrap(&MAIN_SB_IOPT);
+            }
+            else if(opt[OPT_RM].value)
             {
                 _LOG("install qemm\n");
+                if(opt[OPT_OPL].value) QEMM_Install_IOPortTrap(MAIN_OPL3IODT, 4, &OPL3IOPT);
                 QEMM_Install_IOPortTrap(MAIN_VDMA_IODT, countof(MAIN_VDMA_IODT), &MAIN_VDMA_IOPT);
                 QEMM_Install_IOPortTrap(SB_Iodt, SB_IodtCount, &MAIN_SB_IOPT);
                 #if !MAIN_TRAP_PIC_ONDEMAND
@@ -1120,21 +1450,34 @@ static void MAIN_TSR_Interrupt()
                 #endif
             }
 
-            if(opt[OPT_PM].value)
+            if(MAIN_Options[OPT_PM].value && opt[OPT_PM].value)
+            {
+                _LOG("swap hdpmi\n");
+                if(OPLOn) HDPMIPT_Install_IOPortTrap(MAIN_OPL3IODT, 4, &OPL3IOPT_PM);
+                HDPMIPT_Swap_IOPortTrap(&MAIN_SB_IOPT_PM, SB_Iodt, SB_IodtCount);
+                if(OPLOff) HDPMIPT_Uninstall_IOPortTrap(&OPL3IOPT_PM);
+            }
+            else if(MAIN_Options[OPT_PM].value)
+            {
+                _LOG("uninstall hdpmi\n");
+                if(MAIN_Options[OPT_OPL].value) HDPMIPT_Uninstall_IOPortTrap(&OPL3IOPT_PM);
+                HDPMIPT_Uninstall_IOPortTrap(&MAIN_VDMA_IOPT_PM);
+                #if !MAIN_TRAP_PIC_ONDEMAND
+                HDPMIPT_Uninstall_IOPortTrap(&MAIN_VIRQ_IOPT_PM);
+                #endif
+                HDPMIPT_Uninstall_IOPortTrap(&MAIN_SB_IOPT_PM);
+            }
+            else if(opt[OPT_PM].value)
             {
                 _LOG("install hdpmi\n");
-                HDPMIPT_Install_IOPortTrap(0x0, 0xF, MAIN_VDMA_IODT, 16, &MAIN_VDMA_IOPT_PM1);
-                HDPMIPT_Install_IOPortTrap(0x81, 0x83, MAIN_VDMA_IODT+16, 3, &MAIN_VDMA_IOPT_PM2);
-                HDPMIPT_Install_IOPortTrap(0x87, 0x87, MAIN_VDMA_IODT+19, 1, &MAIN_VDMA_IOPT_PM3);
-                HDPMIPT_Install_IOPortTrap(0xC0, 0xDE, MAIN_VDMA_IODT+20, 16, &MAIN_VHDMA_IOPT_PM1);
-                HDPMIPT_Install_IOPortTrap(0x89, 0x8B, MAIN_VDMA_IODT+36, 3, &MAIN_VHDMA_IOPT_PM2);
-                HDPMIPT_Install_IOPortTrap(0x8F, 0x8F, MAIN_VDMA_IODT+39, 1, &MAIN_VHDMA_IOPT_PM3);
+                if(opt[OPT_OPL].value) HDPMIPT_Install_IOPortTrap(MAIN_OPL3IODT, 4, &OPL3IOPT_PM);
+                HDPMIPT_Install_IOPortTrap(MAIN_VDMA_IODT, countof(MAIN_VDMA_IODT), &MAIN_VDMA_IOPT_PM);
                 #if !MAIN_TRAP_PIC_ONDEMAND
-                HDPMIPT_Install_IOPortTrap(0x20, 0x21, MAIN_VIRQ_IODT, 2, &MAIN_VIRQ_IOPT_PM1);
-                HDPMIPT_Install_IOPortTrap(0xA0, 0xA1, MAIN_VIRQ_IODT+2, 2, &MAIN_VIRQ_IOPT_PM2);
+                HDPMIPT_Install_IOPortTrap(MAIN_VIRQ_IODT, countof(MAIN_VIRQ_IODT), &MAIN_VIRQ_IOPT_PM);
                 #endif
-                HDPMIPT_Install_IOPortTrap(MAIN_Options[OPT_ADDR].value, MAIN_Options[OPT_ADDR].value+0x0F, SB_Iodt, SB_IodtCount, &MAIN_SB_IOPT_PM);
+                HDPMIPT_Install_IOPortTrap(SB_Iodt, SB_IodtCount, &MAIN_SB_IOPT_PM);
             }
+            MAIN_Options[OPT_ADDR].value = opt[OPT_ADDR].value;
 
             if(opt[OPT_RM].value)
             {
@@ -1149,6 +1492,9 @@ static void MAIN_TSR_Interrupt()
             MAIN_Options[OPT_PM].value = opt[OPT_PM].value;
             MAIN_Options[OPT_RM].value = opt[OPT_RM].value;
             MAIN_Options[OPT_OPL].value = opt[OPT_OPL].value;
+            MAIN_UpdateGains(); //card volume depends on whether FM is on
+            MAIN_ShareStubState(); //port changed
+            MAIN_UpdatePICShadow(!MAIN_TRAP_PIC_ONDEMAND);
 
             free(opt);
         }
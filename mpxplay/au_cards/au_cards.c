@@ -1112,6 +1112,46 @@ static int aucards_writedata_nowait(struct mpxplay_audioout_info_s *aui,unsigned
  }while(space>=aui->card_bytespersign);
  return outbytes_left;
 }
+
+//zero-copy output: writable part of the DMA buffer at card_dmalastput, split in 2 spans at the buffer end.
+//call AU_cardbuf_space first, render into the spans, then AU_cardbuf_commit. returns the usable bytes, 0 if not supported
+unsigned int AU_cardbuf_getspans(struct mpxplay_audioout_info_s *aui,unsigned long outbytes,char **span1,unsigned int *len1,char **span2,unsigned int *len2)
+{
+ unsigned long buffer_protection,space,todo;
+
+ if(!(aui->card_handler->infobits&SNDCARD_ZEROCOPY) || !aui->card_DMABUFF || (aui->card_infobits&AUINFOS_CARDINFOBIT_BITSTREAMOUT))
+  return 0;
+
+ buffer_protection=SOUNDCARD_BUFFER_PROTECTION;
+ buffer_protection+=aui->card_bytespersign-1;
+ buffer_protection-=(buffer_protection%aui->card_bytespersign);
+
+ space=(aui->card_dmaspace>buffer_protection)? (aui->card_dmaspace-buffer_protection):0;
+ outbytes=min(outbytes,space);
+ outbytes-=(outbytes%aui->card_bytespersign);
+
+ todo=aui->card_dmasize-aui->card_dmalastput;
+ *span1=aui->card_DMABUFF+aui->card_dmalastput;
+ *len1=min(todo,outbytes);
+ *span2=aui->card_DMABUFF;
+ *len2=outbytes-*len1;
+ return outbytes;
+}
+
+void AU_cardbuf_commit(struct mpxplay_audioout_info_s *aui,unsigned long outbytes)
+{
+ aui->card_dmalastput+=outbytes;
+ if(aui->card_dmalastput>=aui->card_dmasize)
+  aui->card_dmalastput-=aui->card_dmasize;
+
+ aui->card_dmafilled+=outbytes;
+ if(aui->card_dmafilled>aui->card_dmasize)
+  aui->card_dmafilled=aui->card_dmasize;
+ if(aui->card_dmaspace>outbytes)
+  aui->card_dmaspace-=outbytes;
+ else
+  aui->card_dmaspace=0;
+}
 #endif
 
 //---------------------------------------------------------------------------
@@ -37,6 +37,7 @@ extern "C" {
 #define SNDCARD_SETRATE        16 // always call setrate before each song (special wav-out and test-out flag!)
 #define SNDCARD_LOWLEVELHAND   32 // native soundcard handling (PCI)
 #define SNDCARD_IGNORE_STARTUP 64 // ignore startup (do not restore songpos) (ie: wav out)
+#define SNDCARD_ZEROCOPY      128 // DMA buffer is plain memory written by MDma_writedata only, can be rendered into directly (SBEMU)
 #define SNDCARD_FLAGS_DISKWRITER (SNDCARD_SELECT_ONLY|SNDCARD_SETRATE|SNDCARD_IGNORE_STARTUP)
 
 //au_cards mixer channels
@@ -289,6 +290,8 @@ extern void AU_clearbuffs(struct mpxplay_audioout_info_s *);
 extern void AU_pause_process(struct mpxplay_audioout_info_s *);
 #ifdef SBEMU
 extern unsigned int AU_cardbuf_space(struct mpxplay_audioout_info_s *aui);
+extern unsigned int AU_cardbuf_getspans(struct mpxplay_audioout_info_s *aui,unsigned long outbytes,char **span1,unsigned int *len1,char **span2,unsigned int *len2);
+extern void AU_cardbuf_commit(struct mpxplay_audioout_info_s *aui,unsigned long outbytes);
 #endif
 extern int  AU_writedata(struct mpxplay_audioout_info_s *);
 
@@ -576,7 +576,7 @@ static unsigned long ES1371_readMIXER(struct mpxplay_audioout_info_s *aui,unsign
 
 one_sndcard_info ES1371_sndcard_info={
  "ENS",
- SNDCARD_LOWLEVELHAND|SNDCARD_INT08_ALLOWED,
+ SNDCARD_LOWLEVELHAND|SNDCARD_INT08_ALLOWED|SNDCARD_ZEROCOPY,
 
  NULL,
  NULL,                 // no init
@@ -706,7 +706,7 @@ static int INTELICH_IRQRoutine(mpxplay_audioout_info_s* aui)
 
 one_sndcard_info ICH_sndcard_info={
  "ICH AC97",
- SNDCARD_LOWLEVELHAND|SNDCARD_INT08_ALLOWED,
+ SNDCARD_LOWLEVELHAND|SNDCARD_INT08_ALLOWED|SNDCARD_ZEROCOPY,
 
  NULL,
  NULL,                   // no init
@@ -1392,7 +1392,7 @@ static aucards_allmixerchan_s ihd_mixerset[]={
 
 one_sndcard_info IHD_sndcard_info={
  "Intel HDA",
- SNDCARD_LOWLEVELHAND|SNDCARD_INT08_ALLOWED,
+ SNDCARD_LOWLEVELHAND|SNDCARD_INT08_ALLOWED|SNDCARD_ZEROCOPY,
 
  NULL,                  // card_config
  NULL,                  // no init
@@ -1407,7 +1407,7 @@ static int SBLIVE_IRQRoutine(struct mpxplay_audioout_info_s *aui)
 
 one_sndcard_info SBLIVE_sndcard_info={
  "SB Live!/Audigy",
- SNDCARD_LOWLEVELHAND|SNDCARD_INT08_ALLOWED,
+ SNDCARD_LOWLEVELHAND|SNDCARD_INT08_ALLOWED|SNDCARD_ZEROCOPY,
 
  NULL,
  NULL,                  // no init
@@ -214,6 +214,65 @@ unsigned int cv_channels_downmix(PCM_CV_TYPE_S *pcm_sample,unsigned int samplenu
 }
 
 //-------------------------------------------------------------------------
+#ifdef SBEMU
+#include "mix_func.h"
+#ifdef DJGPP
+#include <mmintrin.h>
+
+static __attribute__((target("mmx"))) unsigned int cv_channels_mix2_sat_mmx(PCM_CV_TYPE_S *out,const PCM_CV_TYPE_S *a,const PCM_CV_TYPE_S *b,unsigned int samplenum,const PCM_CV_TYPE_S *gain)
+{
+ const __m64 g=_mm_set_pi16(gain[3],gain[2],gain[1],gain[0]); // pairs: (aL,bL),(aR,bR)
+ unsigned int i;
+ for(i=0;i+4<=samplenum;i+=4){
+  const __m64 va=*(const __m64 *)(a+i),vb=*(const __m64 *)(b+i);
+  __m64 lo=_mm_madd_pi16(_mm_unpacklo_pi16(va,vb),g);
+  __m64 hi=_mm_madd_pi16(_mm_unpackhi_pi16(va,vb),g);
+  lo=_mm_srai_pi32(lo,CV_MIX_GAIN_SHIFT);
+  hi=_mm_srai_pi32(hi,CV_MIX_GAIN_SHIFT);
+  *(__m64 *)(out+i)=_mm_packs_pi32(lo,hi); // saturated
+ }
+ return i;
+}
+#endif
+
+void cv_channels_mix2_sat(PCM_CV_TYPE_S *out,const PCM_CV_TYPE_S *a,const PCM_CV_TYPE_S *b,unsigned int samplenum,const PCM_CV_TYPE_S *gain)
+{
+ unsigned int i=0;
+#ifdef DJGPP
+ static int usemmx=-1;
+ if(usemmx<0)
+  usemmx=mixer_cpu_has_mmx();
+ if(usemmx && samplenum>=16){
+  char fpustate[108];
+  asm("fsave %0":"=m"(fpustate)); //MMX shares FPU registers of the interrupted program
+  i=cv_channels_mix2_sat_mmx(out,a,b,samplenum,gain);
+  _mm_empty();
+  asm("frstor %0"::"m"(fpustate));
+ }
+#endif
+ for(;i<samplenum;i++){
+  const PCM_CV_TYPE_S *g=gain+(i&1)*2;
+  long v=((long)a[i]*g[0]+(long)b[i]*g[1])>>CV_MIX_GAIN_SHIFT; //arithmetic shift, same as MMX psrad
+  out[i]=(v>32767)? 32767:((v<-32768)? -32768:v);
+ }
+}
+
+// original SBEMU mix curve: https://stackoverflow.com/questions/12089662/mixing-16-bit-linear-pcm-streams-and-avoiding-clipping-overflow
+void cv_channels_mix2_curve(PCM_CV_TYPE_S *out,const PCM_CV_TYPE_S *a,const PCM_CV_TYPE_S *b,unsigned int samplenum,const PCM_CV_TYPE_S *gain,const PCM_CV_TYPE_S *master)
+{
+ unsigned int i;
+ for(i=0;i<samplenum;i++){
+  const PCM_CV_TYPE_S *g=gain+(i&1)*2;
+  const long va=(((long)a[i]*g[0])>>CV_MIX_GAIN_SHIFT)+32768;
+  const long vb=(((long)b[i]*g[1])>>CV_MIX_GAIN_SHIFT)+32768;
+  const long ab=(long)(((long long)va*vb)>>15); // 64 bit: b is above 16 bits with OPL gain over 1.0
+  long v=(va<32768 || vb<32768)? ab:((va+vb)*2-ab-65536);
+  v=((v-32768)*master[i&1])>>CV_MIX_GAIN_SHIFT;
+  out[i]=(v>32767)? 32767:((v<-32768)? -32768:v);
+ }
+}
+#endif
+
 static void mixer_swapchan_process(struct mpxp_aumixer_passinfo_s *mpi)
 {
  unsigned int samplenum=mpi->samplenum,bytespersample=mpi->bytespersample_mixer;
@@ -24,6 +24,7 @@
 #include <math.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
 
 #ifndef SBEMU
 
@@ -435,48 +436,346 @@ one_mixerfunc_info MIXER_FUNCINFO_seekspeed={
 
 #else
 
-unsigned int mixer_speed_lq(PCM_CV_TYPE_S *pcm16,unsigned int samplenum, unsigned int channels, unsigned int samplerate, unsigned int newrate)
+#include "mix_func.h"
+#ifdef DJGPP
+#include <mmintrin.h>
+#endif
+
+//windowed-sinc (polyphase FIR) tier: fixed cost of MIXER_SPEED_SINC_TAPS MACs per channel per output frame.
+//coefficient banks are precomputed for a few cutoffs (anti-aliasing for downsampling), Q14, each phase sums to 1.0
+#define MIXER_SPEED_SINC_TAPS   (MIXER_SPEED_SINC_RADIUS*2)
+#define MIXER_SPEED_SINC_PHASEBITS 5
+#define MIXER_SPEED_SINC_PHASES (1<<MIXER_SPEED_SINC_PHASEBITS)
+#define MIXER_SPEED_SINC_BANKS  7  // cutoff 8/8..2/8 of input nyquist
+#define MIXER_SPEED_SINC_SHIFT  14
+
+static PCM_CV_TYPE_S mixer_speed_sinc_bank[MIXER_SPEED_SINC_BANKS][MIXER_SPEED_SINC_PHASES][MIXER_SPEED_SINC_TAPS];
+static PCM_CV_TYPE_S mixer_speed_sinc_bank2[MIXER_SPEED_SINC_BANKS][MIXER_SPEED_SINC_PHASES][MIXER_SPEED_SINC_TAPS*2]; // each coeff twice, for interleaved stereo (MMX)
+static unsigned int mixer_speed_sinc_ready,mixer_speed_sinc_mmx;
+
+unsigned int mixer_cpu_has_mmx(void)
 {
- const unsigned int instep=((samplerate/newrate)<<12) | (((4096*(samplerate%newrate)-1)/(newrate-1))&0xFFF);
- const unsigned int inend=(samplenum/channels) << 12;
- PCM_CV_TYPE_S *pcm,*intmp;
- unsigned long ipi;
- unsigned int inpos = 0;//(samplerate<newrate) ? instep/2 : 0;
- if(!samplenum)
+ uint32_t regs[4];
+ if(!PLTFM_CPUID(1,regs))
   return 0;
- assert(((samplenum/channels)&0xFFF00000) == 0); //too many samples, need other approches.
- unsigned int buffcount = max(((unsigned long long)max(samplenum,512)*newrate+samplerate-1)/samplerate,max(samplenum,512))*2+32;
- PCM_CV_TYPE_S* buff = (PCM_CV_TYPE_S*)malloc(buffcount*sizeof(PCM_CV_TYPE_S));
+ return (regs[3]>>23)&1;
+}
 
- mpxplay_debugf(MPXPLAY_DEBUG_OUTPUT, "step: %08x, end: %08x\n", instep, inend);
+static void mixer_speed_sinc_init(void)
+{
+ unsigned int bk,ph,t;
+ if(mixer_speed_sinc_ready)
+  return;
+ for(bk=0;bk<MIXER_SPEED_SINC_BANKS;bk++){
+  const double fc=0.9*(8-bk)/8.0; // keep some transition band below nyquist
+  for(ph=0;ph<MIXER_SPEED_SINC_PHASES;ph++){
+   double h[MIXER_SPEED_SINC_TAPS],sum=0;
+   int isum=0,center=MIXER_SPEED_SINC_RADIUS-1;
+   for(t=0;t<MIXER_SPEED_SINC_TAPS;t++){
+    const double x=(double)t-(MIXER_SPEED_SINC_RADIUS-1)-(double)ph/MIXER_SPEED_SINC_PHASES; // distance from output position
+    const double w=0.42+0.5*cos(M_PI*x/MIXER_SPEED_SINC_RADIUS)+0.08*cos(2*M_PI*x/MIXER_SPEED_SINC_RADIUS); // blackman
+    h[t]=((x==0)? fc:sin(M_PI*fc*x)/(M_PI*x))*((fabs(x)<MIXER_SPEED_SINC_RADIUS)? w:0);
+    sum+=h[t];
+   }
+   for(t=0;t<MIXER_SPEED_SINC_TAPS;t++){
+    int c=(int)floor(h[t]/sum*(1<<MIXER_SPEED_SINC_SHIFT)+0.5);
+    mixer_speed_sinc_bank[bk][ph][t]=c;
+    isum+=c;
+   }
+   if(ph>=MIXER_SPEED_SINC_PHASES/2)
+    center++;
+   mixer_speed_sinc_bank[bk][ph][center]+=(1<<MIXER_SPEED_SINC_SHIFT)-isum; // exact unity gain
+   for(t=0;t<MIXER_SPEED_SINC_TAPS;t++)
+    mixer_speed_sinc_bank2[bk][ph][t*2]=mixer_speed_sinc_bank2[bk][ph][t*2+1]=mixer_speed_sinc_bank[bk][ph][t];
+  }
+ }
+ mixer_speed_sinc_mmx=mixer_cpu_has_mmx();
+ mixer_speed_sinc_ready=1;
+}
 
- pcm = buff;
- intmp = pcm16;
- int total = samplenum/channels;
+static unsigned int mixer_speed_sinc_selectbank(unsigned int samplerate,unsigned int newrate)
+{
+ int bk;
+ if(newrate>=samplerate)
+  return 0;
+ bk=8-(int)(((unsigned long long)newrate*8)/samplerate);
+ return (bk>=MIXER_SPEED_SINC_BANKS)? (MIXER_SPEED_SINC_BANKS-1):bk;
+}
 
- do{
+//streaming resampler: phase and the last input frames are kept between calls,
+//so chunk boundaries don't restart the interpolation. position is 32.32 fixed point,
+//relative to the last carried frame (frame 0, frames -1..-radius are the ones before it).
+void mixer_speed_stream_init(mixer_speed_stream_s *ms,unsigned int channels,unsigned int samplerate,unsigned int newrate)
+{
+ assert(channels && channels<=MIXER_SPEED_STREAM_MAXCHANNELS);
+ memset(ms,0,sizeof(*ms));
+ ms->channels=channels;
+ ms->radius=1;
+ ms->pos=1LL<<32; // first output is the first input frame
+ mixer_speed_stream_setrate(ms,samplerate,newrate);
+}
+
+void mixer_speed_stream_setsinc(mixer_speed_stream_s *ms,unsigned int sinc)
+{
+ if(sinc)
+  mixer_speed_sinc_init(); // uses FPU, don't call it in interrupt handler
+ ms->sinc=sinc? 1:0;
+ ms->radius=sinc? MIXER_SPEED_SINC_RADIUS:1;
+ ms->pos=1LL<<32;
+ memset(ms->history,0,sizeof(ms->history));
+ mixer_speed_stream_setrate(ms,ms->samplerate,ms->newrate);
+}
+
+void mixer_speed_stream_setrate(mixer_speed_stream_s *ms,unsigned int samplerate,unsigned int newrate)
+{
+ ms->samplerate=samplerate;
+ ms->newrate=newrate;
+ ms->step=(((unsigned long long)samplerate)<<32)/newrate;
+ ms->bank=ms->sinc? mixer_speed_sinc_selectbank(samplerate,newrate):0;
+}
+
+unsigned int mixer_speed_stream_need(mixer_speed_stream_s *ms,unsigned int outframes)
+{
+ long long last;
+ if(!outframes)
+  return 0;
+ last=((ms->pos+(long long)(outframes-1)*ms->step)>>32)+ms->radius; // last input frame used by the last output
+ return (last<0)? 0:(unsigned int)last;
+}
+
+static const PCM_CV_TYPE_S *mixer_speed_frame(mixer_speed_stream_s *ms,const PCM_CV_TYPE_S *in,long k)
+{
+ return (k>0)? (in+(k-1)*ms->channels):(ms->history+(k+ms->radius)*ms->channels);
+}
+
+#ifdef DJGPP
+static __attribute__((target("mmx"))) void mixer_speed_sinc_stereo_mmx(PCM_CV_TYPE_S *outptr,const PCM_CV_TYPE_S *win,const PCM_CV_TYPE_S *coef)
+{
+ const __m64 *s=(const __m64 *)win,*c=(const __m64 *)coef;
+ const __m64 maskl=_mm_set_pi32(0x0000FFFF,0x0000FFFF);
+ __m64 accl=_mm_setzero_si64(),accr=_mm_setzero_si64();
+ unsigned int i;
+ for(i=0;i<MIXER_SPEED_SINC_TAPS/2;i++){ // 2 stereo frames per step
+  accl=_mm_add_pi32(accl,_mm_madd_pi16(_mm_and_si64(s[i],maskl),c[i]));
+  accr=_mm_add_pi32(accr,_mm_madd_pi16(_mm_srli_pi32(s[i],16),c[i]));
+ }
+ accl=_mm_add_pi32(accl,_mm_srli_si64(accl,32));
+ accr=_mm_add_pi32(accr,_mm_srli_si64(accr,32));
+ accl=_mm_unpacklo_pi32(accl,accr);
+ accl=_mm_srai_pi32(_mm_add_pi32(accl,_mm_set1_pi32(1<<(MIXER_SPEED_SINC_SHIFT-1))),MIXER_SPEED_SINC_SHIFT);
+ *(int *)outptr=_mm_cvtsi64_si32(_mm_packs_pi32(accl,accl)); // saturated
+}
+#endif
+
+static unsigned int mixer_speed_stream_sinc(mixer_speed_stream_s *ms,PCM_CV_TYPE_S *out,unsigned int outframes,const PCM_CV_TYPE_S *in,unsigned int innum,long long *posp)
+{
+ const unsigned int channels=ms->channels;
+ const long long step=ms->step;
+ PCM_CV_TYPE_S (*bank)[MIXER_SPEED_SINC_TAPS]=mixer_speed_sinc_bank[ms->bank];
+ PCM_CV_TYPE_S window[MIXER_SPEED_SINC_TAPS*MIXER_SPEED_STREAM_MAXCHANNELS];
+ long long pos=*posp;
+ PCM_CV_TYPE_S *outptr=out;
+ unsigned int outnum=0,ch,t;
+#ifdef DJGPP
+ const unsigned int usemmx=(channels==2) && mixer_speed_sinc_mmx;
+ char fpustate[108];
+ if(usemmx)
+  asm("fsave %0":"=m"(fpustate)); //MMX shares FPU registers of the interrupted program
+#endif
+
+ while(outnum<outframes){
+  const long ipi=(long)(pos>>32),first=ipi-MIXER_SPEED_SINC_RADIUS+1;
+  const unsigned int phase=((unsigned int)pos)>>(32-MIXER_SPEED_SINC_PHASEBITS);
+  const PCM_CV_TYPE_S *win;
+  if(ipi+MIXER_SPEED_SINC_RADIUS>(long)innum)
+   break;
+  if(first>0)
+   win=in+(first-1)*channels;
+  else{ // window crosses carried history
+   for(t=0;t<MIXER_SPEED_SINC_TAPS;t++)
+    memcpy(window+t*channels,mixer_speed_frame(ms,in,first+t),channels*sizeof(PCM_CV_TYPE_S));
+   win=window;
+  }
+#ifdef DJGPP
+  if(usemmx)
+   mixer_speed_sinc_stereo_mmx(outptr,win,mixer_speed_sinc_bank2[ms->bank][phase]);
+  else
+#endif
+  for(ch=0;ch<channels;ch++){
+   const PCM_CV_TYPE_S *coef=bank[phase];
+   long acc=1<<(MIXER_SPEED_SINC_SHIFT-1);
+   for(t=0;t<MIXER_SPEED_SINC_TAPS;t++)
+    acc+=(long)win[t*channels+ch]*coef[t];
+   acc>>=MIXER_SPEED_SINC_SHIFT; //arithmetic shift, same as MMX psrad
+   outptr[ch]=(acc>32767)? 32767:((acc<-32768)? -32768:acc);
+  }
+  outptr+=channels;
+  pos+=step;
+  ++outnum;
+ }
+#ifdef DJGPP
+ if(usemmx){
+  _mm_empty();
+  asm("frstor %0"::"m"(fpustate));
+ }
+#endif
+ *posp=pos;
+ return outnum;
+}
+
+static unsigned int mixer_speed_stream_linear(mixer_speed_stream_s *ms,PCM_CV_TYPE_S *out,unsigned int outframes,const PCM_CV_TYPE_S *in,unsigned int innum,long long *posp)
+{
+ const unsigned int channels=ms->channels;
+ const long long step=ms->step;
+ long long pos=*posp;
+ PCM_CV_TYPE_S *outptr=out;
+ unsigned int outnum=0,ch;
+
+ while(outnum<outframes){
+  const long ipi=(long)(pos>>32);
+  const PCM_CV_TYPE_S *intmp1,*intmp2;
   int m1,m2;
-  unsigned int ipi,ch;
-  PCM_CV_TYPE_S *intmp1,*intmp2;
-  ipi = inpos >> 12;
-  m2=inpos&0xFFF;
-  m1=4096-m2;
+  if(ipi>=(long)innum)
+   break;
+  intmp1=mixer_speed_frame(ms,in,ipi);
+  intmp2=mixer_speed_frame(ms,in,ipi+1);
+  m2=((unsigned int)pos)>>17; // 15 bit weight, no overflow for 16 bit samples
+  m1=32768-m2;
   ch=channels;
-  ipi*=ch;
-  intmp1=intmp+ipi;
-  intmp2=ipi < total-ch ? intmp1+ch : intmp1;
   do{
-   *pcm++= ((*intmp1++)*m1+(*intmp2++)*m2)/4096;// >> 12; //don't use shift, signed right shift impl defined, maybe logical shift
+   *outptr++=((*intmp1++)*m1+(*intmp2++)*m2)/32768; //don't use shift, signed right shift impl defined
   }while(--ch);
-  inpos+=instep;
- }while(inpos<inend);
+  pos+=step;
+  ++outnum;
+ }
+ *posp=pos;
+ return outnum;
+}
+
+// carry the last radius+1 consumed frames and rebase the position on them
+static unsigned int mixer_speed_stream_carry(mixer_speed_stream_s *ms,const PCM_CV_TYPE_S *in,unsigned int innum,long long pos)
+{
+ const unsigned int channels=ms->channels,radius=ms->radius;
+ const unsigned int consumed=(pos<0)? 0:(unsigned int)min((unsigned long long)(pos>>32)+1,innum);
+ int k;
+ for(k=-(int)radius;k<=0;k++) // forward copy: source index is never below destination
+  memcpy(ms->history+(k+radius)*channels,mixer_speed_frame(ms,in,(long)consumed+k),channels*sizeof(PCM_CV_TYPE_S));
+ ms->pos=pos-(((long long)consumed)<<32);
+ return consumed;
+}
+
+unsigned int mixer_speed_stream(mixer_speed_stream_s *ms,PCM_CV_TYPE_S *out,unsigned int outframes,const PCM_CV_TYPE_S *in,unsigned int *inframes)
+{
+ long long pos=ms->pos;
+ unsigned int outnum;
+ if(ms->sinc)
+  outnum=mixer_speed_stream_sinc(ms,out,outframes,in,*inframes,&pos);
+ else
+  outnum=mixer_speed_stream_linear(ms,out,outframes,in,*inframes,&pos);
+ *inframes=mixer_speed_stream_carry(ms,in,*inframes,pos);
+ return outnum;
+}
+
+//integer ratio fast paths (linear tier only), same results as mixer_speed_stream.
+//the generic loop is used until the phase is aligned to an input frame, then whole input frames are
+//processed with fixed weights and no per-sample multiply/position math.
+static unsigned int mixer_speed_stream_align(mixer_speed_stream_s *ms,PCM_CV_TYPE_S **outp,unsigned int outframes,const PCM_CV_TYPE_S *in,unsigned int innum,long long *posp)
+{
+ unsigned int outnum=0;
+ while(outnum<outframes && (((unsigned int)*posp) || (*posp>>32)<1) && (*posp>>32)<(long long)innum){
+  mixer_speed_stream_linear(ms,*outp,1,in,innum,posp);
+  *outp+=ms->channels;
+  outnum++;
+ }
+ return outnum;
+}
 
- mpxplay_debugf(MPXPLAY_DEBUG_OUTPUT, "sample count: %d\n", pcm-buff);
- //_LOG("MIXER_SPEED_LQ: %d, %d\n", pcm-buff, buffcount);
- assert(pcm-buff <= buffcount);
- memcpy(pcm16, buff, (pcm-buff)*sizeof(PCM_CV_TYPE_S));
- free(buff);
- return pcm - buff;
+unsigned int mixer_speed_stream_x2(mixer_speed_stream_s *ms,PCM_CV_TYPE_S *out,unsigned int outframes,const PCM_CV_TYPE_S *in,unsigned int *inframes)
+{
+ const unsigned int channels=ms->channels,innum=*inframes;
+ long long pos=ms->pos;
+ PCM_CV_TYPE_S *outptr=out;
+ const PCM_CV_TYPE_S *intmp;
+ unsigned int outnum,n,ch;
+ if(ms->sinc || ms->step!=(1LL<<31))
+  return mixer_speed_stream(ms,out,outframes,in,inframes);
+ outnum=mixer_speed_stream_align(ms,&outptr,outframes,in,innum,&pos);
+ if(!((unsigned int)pos) && (pos>>32)>=1 && (pos>>32)<(long long)innum){
+  intmp=in+((long)(pos>>32)-1)*channels;
+  n=min(innum-(unsigned int)(pos>>32),(outframes-outnum)/2);
+  pos+=((long long)n)<<32;
+  outnum+=n*2;
+  for(;n;n--){
+   for(ch=0;ch<channels;ch++){
+    outptr[ch]=intmp[ch];
+    outptr[channels+ch]=(intmp[ch]+intmp[channels+ch])/2;
+   }
+   intmp+=channels;
+   outptr+=channels*2;
+  }
+ }
+ outnum+=mixer_speed_stream_linear(ms,outptr,outframes-outnum,in,innum,&pos);
+ *inframes=mixer_speed_stream_carry(ms,in,innum,pos);
+ return outnum;
+}
+
+unsigned int mixer_speed_stream_x4(mixer_speed_stream_s *ms,PCM_CV_TYPE_S *out,unsigned int outframes,const PCM_CV_TYPE_S *in,unsigned int *inframes)
+{
+ const unsigned int channels=ms->channels,innum=*inframes;
+ long long pos=ms->pos;
+ PCM_CV_TYPE_S *outptr=out;
+ const PCM_CV_TYPE_S *intmp;
+ unsigned int outnum,n,ch;
+ if(ms->sinc || ms->step!=(1LL<<30))
+  return mixer_speed_stream(ms,out,outframes,in,inframes);
+ outnum=mixer_speed_stream_align(ms,&outptr,outframes,in,innum,&pos);
+ if(!((unsigned int)pos) && (pos>>32)>=1 && (pos>>32)<(long long)innum){
+  intmp=in+((long)(pos>>32)-1)*channels;
+  n=min(innum-(unsigned int)(pos>>32),(outframes-outnum)/4);
+  pos+=((long long)n)<<32;
+  outnum+=n*4;
+  for(;n;n--){
+   for(ch=0;ch<channels;ch++){
+    const int a=intmp[ch],b=intmp[channels+ch];
+    outptr[ch]=a;
+    outptr[channels+ch]=(a*3+b)/4;
+    outptr[channels*2+ch]=(a+b)/2;
+    outptr[channels*3+ch]=(a+b*3)/4;
+   }
+   intmp+=channels;
+   outptr+=channels*4;
+  }
+ }
+ outnum+=mixer_speed_stream_linear(ms,outptr,outframes-outnum,in,innum,&pos);
+ *inframes=mixer_speed_stream_carry(ms,in,innum,pos);
+ return outnum;
+}
+
+unsigned int mixer_speed_stream_d2(mixer_speed_stream_s *ms,PCM_CV_TYPE_S *out,unsigned int outframes,const PCM_CV_TYPE_S *in,unsigned int *inframes)
+{
+ const unsigned int channels=ms->channels,innum=*inframes;
+ long long pos=ms->pos;
+ PCM_CV_TYPE_S *outptr=out;
+ const PCM_CV_TYPE_S *intmp;
+ unsigned int outnum,n,ch;
+ if(ms->sinc || ms->step!=(2LL<<32))
+  return mixer_speed_stream(ms,out,outframes,in,inframes);
+ outnum=mixer_speed_stream_align(ms,&outptr,outframes,in,innum,&pos);
+ if(!((unsigned int)pos) && (pos>>32)>=1 && (pos>>32)<(long long)innum){
+  intmp=in+((long)(pos>>32)-1)*channels;
+  n=min((innum-(unsigned int)(pos>>32)+1)/2,outframes-outnum);
+  pos+=((long long)n)<<33;
+  outnum+=n;
+  for(;n;n--){
+   for(ch=0;ch<channels;ch++)
+    outptr[ch]=intmp[ch];
+   intmp+=channels*2;
+   outptr+=channels;
+  }
+ }
+ outnum+=mixer_speed_stream_linear(ms,outptr,outframes-outnum,in,innum,&pos);
+ *inframes=mixer_speed_stream_carry(ms,in,innum,pos);
+ return outnum;
 }
 
 #endif
@@ -23,7 +23,26 @@ extern void aumixer_cvbits_float64le_to_float32le(PCM_CV_TYPE_S *pcm,unsigned in
 //extern unsigned int mixer_speed_hq(PCM_CV_TYPE_F *pcm,unsigned int samplenum_in);
 //extern unsigned int mixer_speed_lq(PCM_CV_TYPE_S *pcm,unsigned int samplenum_in);
 #ifdef SBEMU
-extern unsigned int mixer_speed_lq(PCM_CV_TYPE_S *pcm16, unsigned int samplenum, unsigned int channels, unsigned int samplerate, unsigned int newrate);
+#define MIXER_SPEED_STREAM_MAXCHANNELS 2
+#define MIXER_SPEED_SINC_RADIUS 4 // windowed-sinc uses 2*radius input frames per output frame
+typedef struct mixer_speed_stream_s{
+ long long pos;         // 32.32 input position, relative to the last carried frame
+ long long step;        // 32.32 input frames per output frame
+ unsigned int channels,samplerate,newrate;
+ unsigned int sinc,radius,bank; // filter tier: linear (radius 1) or windowed-sinc
+ PCM_CV_TYPE_S history[(MIXER_SPEED_SINC_RADIUS+1)*MIXER_SPEED_STREAM_MAXCHANNELS]; // last radius+1 frames of the previous call
+}mixer_speed_stream_s;
+extern void mixer_speed_stream_init(mixer_speed_stream_s *ms,unsigned int channels,unsigned int samplerate,unsigned int newrate);
+extern void mixer_speed_stream_setsinc(mixer_speed_stream_s *ms,unsigned int sinc); // resets the stream. not in interrupt handler (builds coefficients)
+extern void mixer_speed_stream_setrate(mixer_speed_stream_s *ms,unsigned int samplerate,unsigned int newrate); // keeps phase and history
+extern unsigned int mixer_speed_stream_need(mixer_speed_stream_s *ms,unsigned int outframes); // input frames needed for outframes
+// produce up to outframes from *inframes input frames (no heap use). *inframes returns the consumed frames, the rest should be passed again in the next call
+extern unsigned int mixer_speed_stream(mixer_speed_stream_s *ms,PCM_CV_TYPE_S *out,unsigned int outframes,const PCM_CV_TYPE_S *in,unsigned int *inframes);
+// same as above, for exact rate ratios: newrate=samplerate*2, newrate=samplerate*4, samplerate=newrate*2
+extern unsigned int mixer_speed_stream_x2(mixer_speed_stream_s *ms,PCM_CV_TYPE_S *out,unsigned int outframes,const PCM_CV_TYPE_S *in,unsigned int *inframes);
+extern unsigned int mixer_speed_stream_x4(mixer_speed_stream_s *ms,PCM_CV_TYPE_S *out,unsigned int outframes,const PCM_CV_TYPE_S *in,unsigned int *inframes);
+extern unsigned int mixer_speed_stream_d2(mixer_speed_stream_s *ms,PCM_CV_TYPE_S *out,unsigned int outframes,const PCM_CV_TYPE_S *in,unsigned int *inframes);
+extern unsigned int mixer_cpu_has_mmx(void);
 #endif
 
 //cv_chan.c
@@ -32,6 +51,15 @@ extern unsigned int cv_channels_n_to_1(PCM_CV_TYPE_S *pcm_sample,unsigned int sa
 extern unsigned int cv_channels_n_to_2(PCM_CV_TYPE_S *pcm_sample,unsigned int samplenum,unsigned int oldchannels,unsigned int bytespersample);
 extern unsigned int cv_channels_remap(PCM_CV_TYPE_S *pcm_sample,unsigned int samplenum,unsigned int channelnum_in,mpxp_uint8_t *chanmatrix_in,unsigned int channelnum_out,mpxp_uint8_t *chanmatrix_out,unsigned int bytespersample);
 extern unsigned int cv_channels_downmix(PCM_CV_TYPE_S *pcm_sample,unsigned int samplenum,unsigned int channelnum_in,mpxp_uint8_t *chanmatrix_in,unsigned int channelnum_out,mpxp_uint8_t *chanmatrix_out,unsigned int bytespersample);
+#ifdef SBEMU
+#define CV_MIX_GAIN_SHIFT 13 // mix gains are Q13 (8192: 1.0, 32767 max)
+// saturating mix of 2 interleaved stereo streams: out=(a*gain[0]+b*gain[1])>>13 for left, gain[2],gain[3] for right.
+// samplenum must be even. out can be a or b. uses MMX if available
+extern void cv_channels_mix2_sat(PCM_CV_TYPE_S *out,const PCM_CV_TYPE_S *a,const PCM_CV_TYPE_S *b,unsigned int samplenum,const PCM_CV_TYPE_S *gain);
+// non-linear mix (a*b/32768 curve) of 2 interleaved stereo streams: a,b scaled by gain pairs as above, mixed,
+// then scaled by master[0] (left), master[1] (right) and saturated. samplenum must be even. out can be a or b
+extern void cv_channels_mix2_curve(PCM_CV_TYPE_S *out,const PCM_CV_TYPE_S *a,const PCM_CV_TYPE_S *b,unsigned int samplenum,const PCM_CV_TYPE_S *gain,const PCM_CV_TYPE_S *master);
+#endif
 
 //analiser.c
 extern void mixer_get_volumelevel(PCM_CV_TYPE_S *pcm,unsigned int samplenum,unsigned int channelnum);
@@ -0,0 +1,185 @@
+#include <string.h>
+#include <dpmi/dpmi.h>
+#include <dpmi/dbgutil.h>
+#include <sbemucfg.h>
+#include <sbemu.h>
+#include <vdma.h>
+#include <opl3emu.h>
+#include "pipeline.h"
+
+#define PIPELINE_MARK(pipe) do { if((pipe)->Cycles) (pipe)->TSC = PLTFM_RDTSC(); } while(0)
+#define PIPELINE_ADD(pipe, stage) do { if((pipe)->Cycles) { uint64_t tsc = PLTFM_RDTSC(); (pipe)->Cycles[stage] += tsc - (pipe)->TSC; (pipe)->TSC = tsc; } } while(0)
+
+int PIPELINE_Render(PIPELINE* pipe, int samples, BOOL* digital)
+{
+    *digital = SBEMU_HasStarted();
+    int dma = (SBEMU_GetBits() <= 8 || !pipe->HighDMA) ? SBEMU_GetDMA() : SBEMU_GetHDMA();
+    int32_t DMA_Count = VDMA_GetCounter(dma); //count in bytes
+    if(*digital)//&& DMA_Count != 0x10000) //-1(0xFFFF)+1=0
+    {
+        uint32_t DMA_Addr = VDMA_GetAddress(dma);
+        int32_t DMA_Index = VDMA_GetIndex(dma);
+        uint32_t SB_Bytes = SBEMU_GetSampleBytes();
+        uint32_t SB_Pos = SBEMU_GetPos();
+        uint32_t SB_Rate = SBEMU_GetSampleRate();
+        int samplesize = max(1, SBEMU_GetBits()/8); //sample size in bytes 1 for 8bit. 2 for 16bit
+        int channels = SBEMU_GetChannels();
+        _LOG("sample rate: %d %d\n", SB_Rate, pipe->CardRate);
+        _LOG("channels: %d, size:%d\n", channels, samplesize);
+        //_LOG("DMA index: %x\n", DMA_Index);
+        //_LOG("digital start\n");
+        int pos = 0;
+        do {
+            int count = samples-pos;
+            BOOL resample = (SB_Rate < pipe->CardRate-PIPELINE_RATE_TOLERANCE || SB_Rate > pipe->CardRate+PIPELINE_RATE_TOLERANCE); //don't resample if sample rates are close
+            if(resample)
+            {
+                if(pipe->Resampler.samplerate != SB_Rate || pipe->Resampler.newrate != pipe->CardRate)
+                {
+                    mixer_speed_stream_setrate(&pipe->Resampler, SB_Rate, pipe->CardRate);
+                    //fast paths for exact ratios: 11025/22050=>44100, 12000/24000=>48000, 44100=>22050
+                    if(pipe->CardRate == SB_Rate*2)
+                        pipe->ResampleFunc = &mixer_speed_stream_x2;
+                    else if(pipe->CardRate == SB_Rate*4)
+                        pipe->ResampleFunc = &mixer_speed_stream_x4;
+                    else if(SB_Rate == pipe->CardRate*2)
+                        pipe->ResampleFunc = &mixer_speed_stream_d2;
+                    else
+                        pipe->ResampleFunc = &mixer_speed_stream;
+                }
+                count = max(0, (int)mixer_speed_stream_need(&pipe->Resampler, count) - pipe->SBPCM_Count); //frames already converted
+                count = min(count, pipe->SBPCM_Frames-pipe->SBPCM_Count);
+            }
+            else
+                pipe->SBPCM_Count = 0;
+            count = min(count, max(1,(DMA_Count)/samplesize/channels)); //max for stereo initial 1 byte
+            count = min(count, max(1,(SB_Bytes-SB_Pos)/samplesize/channels)); //max for stereo initial 1 byte. 1/2channel = 0, make it 1
+            if(SBEMU_GetBits()<8) //ADPCM 8bit: frames to bytes. round down, decoded frames must fit the room clamped above
+                count = max(1, count / (9 / SBEMU_GetBits()));
+            _LOG("samples:%d %d %d, %d %d, %d %d\n", samples, pos+count, count, DMA_Count, DMA_Index, SB_Bytes, SB_Pos);
+            int bytes = count * samplesize * channels;
+
+            PIPELINE_MARK(pipe);
+            uint32_t linear = bytes ? VDMA_AcquireLinear(DMA_Addr+DMA_Index, bytes) : 0;
+            //_LOG("DMA_ADDR:%x, %x\n",DMA_Addr+DMA_Index, linear);
+            const uint8_t* src = pipe->DMABUF;
+            if(linear == 0) //map failed?
+                memset(pipe->DMABUF, SBEMU_GetBits() == 16 ? 0 : 0x80, bytes);
+            else if(linear < 1024*1024 && pipe->NearLinear) //conventional memory: no bounce copy
+                src = (const uint8_t*)DPMI_L2PTR(linear);
+            else
+                DPMI_CopyLinear(DPMI_PTR2L(pipe->DMABUF), linear, bytes);
+            int16_t* pcm = resample ? pipe->SBPCM+pipe->SBPCM_Count*2 : pipe->PCM+pos*2;
+            count = bytes ? SBEMU_GetConverter()(pcm, src, bytes) : 0; //decode/bits/channels in one pass, to 16bit stereo
+            if(linear)
+                VDMA_ReleaseLinear(linear);
+            PIPELINE_ADD(pipe, PIPELINE_CONVERT);
+            if(resample/*SB_Rate != pipe->CardRate*/)
+            {
+                int frames = pipe->SBPCM_Count + count;
+                unsigned int consumed = frames;
+                count = pipe->ResampleFunc(&pipe->Resampler, pipe->PCM+pos*2, samples-pos, pipe->SBPCM, &consumed);
+                pipe->SBPCM_Count = frames - consumed; //keep the rest for next chunk
+                memmove(pipe->SBPCM, pipe->SBPCM+consumed*2, pipe->SBPCM_Count*sizeof(int16_t)*2);
+                PIPELINE_ADD(pipe, PIPELINE_RESAMPLE);
+            }
+            pos += count;
+            //_LOG("samples:%d %d %d\n", count, pos, samples);
+            DMA_Index = VDMA_SetIndexCounter(dma, DMA_Index+bytes, DMA_Count-bytes);
+            DMA_Count = VDMA_GetCounter(dma);
+            SB_Pos = SBEMU_SetPos(SB_Pos+bytes);
+            //_LOG("SB bytes: %d %d\n", SB_Pos, SB_Bytes);
+            if(SB_Pos >= SB_Bytes)
+            {
+                //_LOG("INT:%d,%d,%d,%d\n",MAIN_SBBytes,SBEMU_GetSampleBytes(),MAIN_DMAIndex,DMA_Count);
+                //_LOG("SBEMU: Auto: %d\n",SBEMU_GetAuto());
+                if(!SBEMU_GetAuto())
+                    SBEMU_Stop();
+                SB_Pos = SBEMU_SetPos(0);
+
+                pipe->RaiseIRQ();
+                if(SB_Bytes <= 32) //detection routine?
+                {
+                    int c = SBEMU_GetDetectionCounter();
+                    if(++c >= 256) //Miles Sound will "freeze" or crash when we continually send virtual interrupt to it, it seems it processes slow and virtual interrupt keeps happening until crash.
+                        SBEMU_Stop(); //fix problem when Miles Sound using SB driver on SBPro emulation
+                    SBEMU_SetDetectionCounter(c);
+                    break; //fix crash in virtualbox.
+                }
+
+                SB_Bytes = SBEMU_GetSampleBytes();
+                SB_Pos = SBEMU_GetPos();
+                SB_Rate = SBEMU_GetSampleRate();
+                //incase IRQ handler re-programs DMA
+                DMA_Index = VDMA_GetIndex(dma);
+                DMA_Count = VDMA_GetCounter(dma);
+                DMA_Addr = VDMA_GetAddress(dma);
+                //_LOG("DMACount: %d, DMAIndex:%d, DMA_Addr:%x\n",DMA_Count, DMA_Index, DMA_Addr);
+            }
+        } while(VDMA_GetAuto(dma) && (pos < samples) && SBEMU_HasStarted());
+        //_LOG("digital end %d %d\n", samples, pos);
+        samples = min(samples, pos);
+    }
+    else if(SBEMU_GetDirectCount()>=3)
+    {
+        samples = min(SBEMU_GetDirectCount(), pipe->SBPCM_Frames*2);
+        _LOG("direct out:%d %d\n",samples,pipe->CardSamplesPerInt);
+        PIPELINE_MARK(pipe);
+        const uint8_t* direct = SBEMU_GetDirectPCM8();
+        #if 1 //fix noise for some games
+        int zeros = TRUE;
+        for(int i = 0; i < samples && zeros; ++i)
+        {
+            if(direct[i] != 0)
+                zeros = FALSE;
+        }
+        #else
+        int zeros = FALSE;
+        #endif
+        //for(int i = 0; i < samples; ++i) _LOG("%d ",direct[i]); _LOG("\n");
+        //the 1st sample is the last one of previous output, already in resampler history
+        if(zeros)
+            memset(pipe->SBPCM, 128, samples-1);
+        else
+            memcpy(pipe->SBPCM, direct+1, samples-1);
+        SBEMU_ResetDirect();
+        cv_bits_n_to_m(pipe->SBPCM, samples-1, 1, 2);
+        //for(int i = 0; i < samples; ++i) _LOG("%d ",pipe->PCM[i]); _LOG("\n");
+        const int interrupt_frequency = pipe->CardRate/pipe->CardSamplesPerInt;
+        mixer_speed_stream_setrate(&pipe->DirectResampler, (samples-1)*interrupt_frequency, pipe->CardRate);
+        unsigned int consumed = samples-1;
+        pipe->SBPCM_Count = 0;
+        samples = mixer_speed_stream(&pipe->DirectResampler, pipe->PCM, pipe->PCM_Frames, pipe->SBPCM, &consumed);
+        //for(int i = 0; i < samples; ++i) _LOG("%d ",pipe->PCM[i]); _LOG("\n");
+        cv_channels_1_to_n(pipe->PCM, samples, 2, 2);
+        PIPELINE_ADD(pipe, PIPELINE_RESAMPLE);
+        *digital = TRUE;
+    }
+
+    PIPELINE_MARK(pipe);
+    if(pipe->OPL)
+    {
+        int16_t* pcm = *digital ? pipe->OPLPCM : pipe->PCM;
+        OPL3EMU_GenSamples(pcm, samples); //will generate samples*2 if stereo
+        //always use 2 channels
+        int channels = OPL3EMU_GetMode() ? 2 : 1;
+        if(channels == 1)
+            cv_channels_1_to_n(pcm, samples, 2, SBEMU_BITS/8);
+        PIPELINE_ADD(pipe, PIPELINE_OPL);
+    }
+    return samples;
+}
+
+void PIPELINE_Mix(PIPELINE* pipe, int16_t* dst, int start, int count, BOOL digital)
+{
+    PIPELINE_MARK(pipe);
+    if(pipe->OPL && digital && pipe->LinearMix)
+        cv_channels_mix2_sat(dst, pipe->PCM+start, pipe->OPLPCM+start, count, pipe->GainMix);
+    else if(pipe->OPL && digital)
+        cv_channels_mix2_curve(dst, pipe->PCM+start, pipe->OPLPCM+start, count, pipe->GainMix, pipe->GainMaster);
+    else if(pipe->OPL || digital)
+        cv_channels_mix2_sat(dst, pipe->PCM+start, pipe->PCM+start, count, digital ? pipe->GainVoice : pipe->GainMidi);
+    else
+        memset(dst, 0, count*sizeof(int16_t)); //output muted samples.
+    PIPELINE_ADD(pipe, PIPELINE_MIX);
+}
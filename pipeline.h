@@ -0,0 +1,70 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+//audio pipeline of the card interrupt: guest DMA fetch & format conversion, resampling, OPL synthesis and final mix.
+//used by MAIN_Interrupt and by the host benchmark (test/bench.c), so the benchmark runs the same code.
+
+#include <platform.h>
+#include <mpxplay.h>
+#include <au_mixer/mix_func.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+enum EPipelineStage
+{
+    PIPELINE_CONVERT, //DMA fetch and format conversion
+    PIPELINE_RESAMPLE,
+    PIPELINE_OPL,
+    PIPELINE_MIX,
+    PIPELINE_STAGES,
+};
+
+#define PIPELINE_RATE_TOLERANCE 50 //rates this close are not resampled
+
+typedef unsigned int (*PIPELINE_RESAMPLE_FUNC)(mixer_speed_stream_s*, PCM_CV_TYPE_S*, unsigned int, const PCM_CV_TYPE_S*, unsigned int*);
+
+typedef struct
+{
+    //set by owner
+    int CardRate;
+    int CardSamplesPerInt; //card frames per interrupt, paces direct DAC output
+    BOOL OPL; //OPL emulation on
+    BOOL HighDMA; //16bit transfers on high DMA (SB16)
+    BOOL NearLinear; //conventional memory accessible as near ptr: guest DMA buffers below 1M read in place
+    void (*RaiseIRQ)(void); //end of DSP block: invoke guest's virtual IRQ
+    uint64_t* Cycles; //TSC cycles per stage (PIPELINE_STAGES) are added if not NULL. needs RDTSC (586+)
+
+    //buffers. PCM, OPLPCM & DMABUF are per interrupt, SBPCM is persistent
+    int16_t* PCM; //digital output at card rate, stereo. OPL output if no digital
+    int16_t* OPLPCM; //OPL output if digital present
+    int PCM_Frames; //capacity of PCM & OPLPCM
+    uint8_t* DMABUF; //raw guest DMA bytes, if not read in place
+    int16_t* SBPCM; //converted stereo samples at SB rate, input of resampler
+    int SBPCM_Frames; //capacity
+    int SBPCM_Count; //frames not consumed by resampler yet
+
+    BOOL LinearMix; //digital+OPL: saturating linear sum instead of the non-linear curve
+    int16_t GainMix[4]; //digital+OPL: (voice, OPL) pairs for left, right. Q13 (CV_MIX_GAIN_SHIFT). master included if LinearMix
+    int16_t GainMaster[2]; //digital+OPL, not LinearMix: master for left, right, applied after the curve
+    int16_t GainVoice[4]; //digital only
+    int16_t GainMidi[4]; //OPL only
+
+    mixer_speed_stream_s Resampler;
+    mixer_speed_stream_s DirectResampler;
+    PIPELINE_RESAMPLE_FUNC ResampleFunc;
+    uint64_t TSC;
+}PIPELINE;
+
+//render up to 'samples' card frames of digital & OPL output into PCM/OPLPCM. return frames rendered, digital: digital output present
+int PIPELINE_Render(PIPELINE* pipe, int samples, BOOL* digital);
+
+//mix digital (PCM) and OPL (OPLPCM, or PCM if no digital) samples [start, start+count) into dst. dst can be PCM
+void PIPELINE_Mix(PIPELINE* pipe, int16_t* dst, int start, int count, BOOL digital);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif//_PIPELINE_H_
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <dos.h>
 #include <fcntl.h>
 #include <assert.h>
@@ -13,11 +14,28 @@
 #include <untrapio.h>
 
 #define HANDLE_IN_388H_DIRECTLY 1
+#define HANDLE_DSP_STATUS_DIRECTLY 1 //2xCh/2xEh reads from QEMM_SBSTATE
+
+#define HANDLE_OUT_389H_POSTED 1 //389h data writes queued to OPL3EMU_POSTRING, if QEMM_SBSTATE.OPLPost set
+
+//DOS memory layout: 0: RMCB far ptr, 4: OPL index, 5: OPL timer ctrl, 8: QEMM_SBSTATE, 24: OPL3EMU_POSTRING, 540: stub code
+#define QEMM_DOSMEM_OPLINDEX 4 //also written by OPL3EMU on index writes not seen by the stub (see OPL3EMU_SetIndexLatch)
+#define QEMM_DOSMEM_SBSTATE 8
+#define QEMM_DOSMEM_OPLPOST 24
+#define QEMM_DOSMEM_CODE 540
+_Static_assert(sizeof(QEMM_SBSTATE) == QEMM_DOSMEM_OPLPOST - QEMM_DOSMEM_SBSTATE, "stub offsets mismatch");
+_Static_assert(offsetof(QEMM_SBSTATE, DSP.WSReady) == 4 && offsetof(QEMM_SBSTATE, SBPort) == 12 && offsetof(QEMM_SBSTATE, OPLPost) == 14, "stub offsets mismatch");
+_Static_assert(OPL3EMU_POST_COUNT == 256 && QEMM_DOSMEM_OPLPOST + sizeof(OPL3EMU_POSTRING) == QEMM_DOSMEM_CODE, "stub offsets mismatch");
 
 int QEMM_TrapFlags;
 
 static QEMM_IODT_LINK QEMM_IODT_header;
 static QEMM_IODT_LINK* QEMM_IODT_Link = &QEMM_IODT_header;
+static QEMM_IOTRAP_HANDLER QEMM_DispatchTable[QEMM_DISPATCH_PORTS];
+#if QEMM_TRAP_STATS
+QEMM_TRAPSTAT QEMM_TrapStats[QEMM_DISPATCH_PORTS]; //shared by QEMM & HDPMI dispatchers
+#endif
+static uint8_t QEMM_TrapTypes;
 static uint16_t QEMM_EntryIP;
 static uint16_t QEMM_EntryCS;
 
@@ -31,16 +49,60 @@ static void __NAKED QEMM_RM_Wrapper()
     _ASM_BEGIN16
         //_ASM(pushf)
         //_ASM(cli)
+#if HANDLE_DSP_STATUS_DIRECTLY //offsets: QEMM_DOSMEM_SBSTATE+0: WS, +1: RS, +2: IntPending, +3: WSPolicy, +4: WSReady, +12: port
+        _ASM(test cl, 0xCF) //QEMM_IOTYPE_DIRMASK
+        _ASM(jnz notdsp)
+        _ASM(push ax)
+        _ASM(mov ax, cs:[20])
+        _ASM(test ax, ax)
+        _ASM(jz notdsppop)
+        _ASM(add ax, 0x0C)
+        _ASM(cmp dx, ax)
+        _ASM(je dspws)
+        _ASM(add ax, 0x02)
+        _ASM(cmp dx, ax)
+        _ASM(jne notdsppop)
+        _ASM(cmp byte ptr cs:[10], 0) //reading 2xEh acks pending 8bit interrupt, do it in PM
+        _ASM(jne notdsppop)
+        _ASM(pop ax)
+        _ASM(xor byte ptr cs:[9], 0x80)
+        _ASM(mov al, cs:[9])
+        _ASM(jmp ret)
+    _ASMLBL(dspws:)
+        _ASM(pop ax)
+        _ASM(cmp byte ptr cs:[11], 0) //SBEMU_WS_TOGGLE
+        _ASM(jne dspwsbusy)
+        _ASM(xor byte ptr cs:[8], 0x80)
+        _ASM(jmp dspwsret)
+    _ASMLBL(dspwsbusy:) //SBEMU_WS_TIMED: clear busy bit once TSC passed WSReady. SBEMU_WS_READY: bit never set
+        _ASM(test byte ptr cs:[8], 0x80)
+        _ASM(jz dspwsret)
+        _ASM(push edx)
+        _ASM(push eax)
+        _ASM(rdtsc)
+        _ASM(sub eax, dword ptr cs:[12])
+        _ASM(sbb edx, dword ptr cs:[16])
+        _ASM(pop eax)
+        _ASM(pop edx)
+        _ASM(js dspwsret) //still busy
+        _ASM(and byte ptr cs:[8], 0x7F)
+    _ASMLBL(dspwsret:)
+        _ASM(mov al, cs:[8])
+        _ASM(jmp ret)
+    _ASMLBL(notdsppop:)
+        _ASM(pop ax)
+    _ASMLBL(notdsp:)
+#endif
 #if HANDLE_IN_388H_DIRECTLY
         _ASM(cmp dx, 0x388)
         _ASM(je next)
         _ASM(cmp dx, 0x389)
         _ASM(jne normal)
-        _ASM(test cl, cl)
+        _ASM(test cl, 0xCF) //QEMM_IOTYPE_DIRMASK
         _ASM(jnz OUT389H)
         _ASM(jmp normal) //in 389h
     _ASM(next:)
-        _ASM(test cl, cl)
+        _ASM(test cl, 0xCF) //QEMM_IOTYPE_DIRMASK
         _ASM(jnz OUT388H)
         _ASM(mov al, cs:[5]) //in 388h
         _ASM(and al, 0x03)
@@ -58,9 +120,41 @@ static void __NAKED QEMM_RM_Wrapper()
         _ASM(jmp ret)
     _ASMLBL(OUT389H:)
         _ASM(cmp byte ptr cs:[4], 4) //timer reg?
+#if HANDLE_OUT_389H_POSTED
+        _ASM(jne post389h)
+#else
         _ASM(jne normal)
+#endif
         _ASM(mov cs:[5], al)
         _ASM(jmp normal)        
+#if HANDLE_OUT_389H_POSTED //offsets: 22: OPLPost, 24: Head, 26: Tail, 28: Data
+    _ASMLBL(post389h:)
+        _ASM(cmp byte ptr cs:[22], 0)
+        _ASM(je normal)
+        _ASM(push ax)
+        _ASM(push bx)
+        _ASM(mov ah, cs:[4])
+        _ASM(mov bx, cs:[24])
+        _ASM(push bx)
+        _ASM(inc bx)
+        _ASM(and bx, 0xFF)
+        _ASM(cmp bx, cs:[26])
+        _ASM(pop bx)
+        _ASM(je postfull) //let handler flush & write it
+        _ASM(shl bx, 1)
+        _ASM(mov cs:[bx+28], ax)
+        _ASM(shr bx, 1)
+        _ASM(inc bx)
+        _ASM(and bx, 0xFF)
+        _ASM(mov cs:[24], bx) //publish after data written
+        _ASM(pop bx)
+        _ASM(pop ax)
+        _ASM(jmp ret)
+    _ASMLBL(postfull:)
+        _ASM(pop bx)
+        _ASM(pop ax)
+        _ASM(jmp normal)
+#endif
     _ASMLBL(OUT388H:)
         _ASM(mov cs:[4], al)
     _ASMLBL(normal:)
@@ -78,26 +172,22 @@ static void QEMM_TrapHandler()
 {
     uint16_t port = QEMM_TrapHandlerREG.w.dx;
     uint8_t val = QEMM_TrapHandlerREG.h.al;
-    uint8_t out = QEMM_TrapHandlerREG.h.cl;
-    QEMM_IODT_LINK* link = QEMM_IODT_header.next;
+    uint8_t out = QEMM_TrapHandlerREG.h.cl&QEMM_IOTYPE_DIRMASK;
+    QEMM_TrapTypes |= QEMM_TrapHandlerREG.h.cl;
 
     //_LOG("Port trap: %s %x\n", out ? "out" : "in", port);
     QEMM_TrapFlags &= ~QEMM_TF_PM;
     QEMM_InCallback = TRUE;
-    while(link)
+    QEMM_TRAPSTAT_MARK(tsc);
+    QEMM_IOTRAP_HANDLER handler = QEMM_FindHandler(&QEMM_IODT_header, QEMM_DispatchTable, port);
+    if(handler)
     {
-        for(int i = 0; i < link->count; ++i)
-        {
-            if((link->iodt[i].port&0xFFFF) == port)
-            {
-                QEMM_TrapHandlerREG.w.flags &= ~CPU_CFLAG;
-                //uint8_t val2 = link->iodt[i].handler(port, val, out);
-                //QEMM_TrapHandlerREG.h.al = out ? QEMM_TrapHandlerREG.h.al : val2;
-                QEMM_TrapHandlerREG.h.al = link->iodt[i].handler(port, val, out);
-                return;
-            }
-        }
-        link = link->next;
+        QEMM_TrapHandlerREG.w.flags &= ~CPU_CFLAG;
+        //uint8_t val2 = handler(port, val, out);
+        //QEMM_TrapHandlerREG.h.al = out ? QEMM_TrapHandlerREG.h.al : val2;
+        QEMM_TrapHandlerREG.h.al = handler(port, val, out);
+        QEMM_TRAPSTAT_ADD(tsc, port, out);
+        return;
     }
     QEMM_InCallback = FALSE;
     
@@ -106,9 +196,11 @@ static void QEMM_TrapHandler()
     r.w.cs = QEMM_OldCallbackCS;
     r.w.ip = QEMM_OldCallbackIP;
     r.w.ss = 0; r.w.sp = 0;
+    r.w.flags &= ~CPU_IFLAG; //no IRQ in chained handler: its ISR's trapped PIC EOI would re-enter this callback and its single stack
     DPMI_CallRealModeRETF(&r);
     QEMM_TrapHandlerREG.w.flags |= r.w.flags&CPU_CFLAG;
     QEMM_TrapHandlerREG.h.al = r.h.al;
+    QEMM_TRAPSTAT_ADD(tsc, port, out);
 }
 
 //https://www.cs.cmu.edu/~ralf/papers/qpi.txt
@@ -164,6 +256,72 @@ uint16_t QEMM_GetVersion(void)
     return 0;
 }
 
+void QEMM_BuildDispatchTable(const QEMM_IODT_LINK* header, QEMM_IOTRAP_HANDLER* table)
+{
+    memset(table, 0, sizeof(QEMM_IOTRAP_HANDLER)*QEMM_DISPATCH_PORTS);
+    for(const QEMM_IODT_LINK* link = header->next; link; link = link->next)
+    {
+        for(int i = 0; i < link->count; ++i)
+        {
+            uint32_t port = link->iodt[i].port&0xFFFF; //high word: QEMM previous trap state
+            if(port < QEMM_DISPATCH_PORTS && table[port] == NULL)
+                table[port] = link->iodt[i].handler;
+        }
+    }
+}
+
+QEMM_IOTRAP_HANDLER QEMM_FindHandler(const QEMM_IODT_LINK* header, const QEMM_IOTRAP_HANDLER* table, uint32_t port)
+{
+    if(port < QEMM_DISPATCH_PORTS)
+        return table[port];
+    for(const QEMM_IODT_LINK* link = header->next; link; link = link->next)
+    {
+        for(int i = 0; i < link->count; ++i)
+        {
+            if((link->iodt[i].port&0xFFFF) == port)
+                return link->iodt[i].handler;
+        }
+    }
+    return NULL;
+}
+
+uint32_t QEMM_GetSBState(void)
+{
+    return QEMM_DOSMEM ? DPMI_SEGOFF2L(QEMM_DOSMEM, QEMM_DOSMEM_SBSTATE) : 0;
+}
+
+uint32_t QEMM_GetOPLPostRing(void)
+{
+    return QEMM_DOSMEM ? DPMI_SEGOFF2L(QEMM_DOSMEM, QEMM_DOSMEM_OPLPOST) : 0;
+}
+
+uint32_t QEMM_GetOPLIndexLatch(void)
+{
+    return QEMM_DOSMEM ? DPMI_SEGOFF2L(QEMM_DOSMEM, QEMM_DOSMEM_OPLINDEX) : 0;
+}
+
+uint32_t QEMM_GetTrapStats(void)
+{
+    #if QEMM_TRAP_STATS
+    return DPMI_PTR2L(QEMM_TrapStats);
+    #else
+    return 0;
+    #endif
+}
+
+void QEMM_ResetTrapStats(void)
+{
+    #if QEMM_TRAP_STATS
+    memset(QEMM_TrapStats, 0, sizeof(QEMM_TrapStats));
+    #endif
+    QEMM_TrapTypes = 0;
+}
+
+uint8_t QEMM_GetTrapTypes(void)
+{
+    return QEMM_TrapTypes;
+}
+
 BOOL QEMM_GetIOPrtTrap_Context(DPMI_REG* regs)
 {
     if(!QEMM_InCallback)
@@ -192,7 +350,7 @@ BOOL QEMM_Install_IOPortTrap(QEMM_IODT* inputp iodt, uint16_t count, QEMM_IOPT*
         {
             uint32_t codesize = (uintptr_t)&QEMM_RM_WrapperEnd - (uintptr_t)&QEMM_RM_Wrapper;
             //_LOG("QEMM dos mem size: %d\n", codesize);
-            QEMM_DOSMEM = DPMI_HighMalloc((codesize + 4 + 2 + 15)>>4, TRUE);
+            QEMM_DOSMEM = DPMI_HighMalloc((codesize + QEMM_DOSMEM_CODE + 15)>>4, TRUE);
             uint32_t rmcb = DPMI_AllocateRMCB_RETF(&QEMM_TrapHandler, &QEMM_TrapHandlerREG);
             if(rmcb == 0)
             {
@@ -201,9 +359,12 @@ BOOL QEMM_Install_IOPortTrap(QEMM_IODT* inputp iodt, uint16_t count, QEMM_IOPT*
                 return FALSE;
             }
             DPMI_CopyLinear(DPMI_SEGOFF2L(QEMM_DOSMEM, 0), DPMI_PTR2L(&rmcb), 4);
+            QEMM_SBSTATE state = {0}; //disabled until set by user
+            DPMI_CopyLinear(DPMI_SEGOFF2L(QEMM_DOSMEM, QEMM_DOSMEM_SBSTATE), DPMI_PTR2L(&state), sizeof(state));
+            DPMI_SetLinear(DPMI_SEGOFF2L(QEMM_DOSMEM, QEMM_DOSMEM_OPLPOST), 0, sizeof(OPL3EMU_POSTRING));
             void* buf = malloc(codesize);
             memcpy_c2d(buf, &QEMM_RM_Wrapper, codesize); //copy to ds seg in case cs&ds are not same
-            DPMI_CopyLinear(DPMI_SEGOFF2L(QEMM_DOSMEM, 4+2), DPMI_PTR2L(buf), codesize);
+            DPMI_CopyLinear(DPMI_SEGOFF2L(QEMM_DOSMEM, QEMM_DOSMEM_CODE), DPMI_PTR2L(buf), codesize);
             free(buf);
         }
 
@@ -211,7 +372,7 @@ BOOL QEMM_Install_IOPortTrap(QEMM_IODT* inputp iodt, uint16_t count, QEMM_IOPT*
         r.w.ip = QEMM_EntryIP;
         r.w.ax = 0x1A07;
         r.w.es = QEMM_DOSMEM&0xFFFF;
-        r.w.di = 4+2;
+        r.w.di = QEMM_DOSMEM_CODE;
         if( DPMI_CallRealModeRETF(&r) != 0 || (r.w.flags&CPU_CFLAG))
         {
             DPMI_HighFree(QEMM_DOSMEM);
@@ -248,11 +409,95 @@ BOOL QEMM_Install_IOPortTrap(QEMM_IODT* inputp iodt, uint16_t count, QEMM_IOPT*
     CLIS();
     QEMM_IODT_Link->next = newlink;
     QEMM_IODT_Link = newlink;
+    QEMM_BuildDispatchTable(&QEMM_IODT_header, QEMM_DispatchTable);
     STIL();
     iopt->memory = (uintptr_t)newlink;
     return TRUE;
 }
 
+BOOL QEMM_Swap_IOPortTrap(QEMM_IOPT* inputp iopt, QEMM_IODT* inputp iodt, uint16_t count)
+{
+    QEMM_IODT_LINK* link = (QEMM_IODT_LINK*)iopt->memory;
+    QEMM_IODT* mem = (QEMM_IODT*)malloc(sizeof(QEMM_IODT)*count);
+    memcpy(mem, iodt, sizeof(QEMM_IODT)*count);
+
+    uint8_t* added = (uint8_t*)malloc(count); //trapped by this call
+    int i = 0;
+    for(; i < count; ++i)
+    {
+        added[i] = FALSE;
+        int j = 0;
+        while(j < link->count && (link->iodt[j].port&0xFFFF) != (mem[i].port&0xFFFF))
+            ++j;
+        if(j < link->count) //kept trapped, inherit previous state
+        {
+            mem[i].port = (mem[i].port&0xFFFF) | (link->iodt[j].port&0xFFFF0000L);
+            continue;
+        }
+        DPMI_REG r = {0};
+        r.w.cs = QEMM_EntryCS;
+        r.w.ip = QEMM_EntryIP;
+        r.w.ax = 0x1A08;
+        r.w.dx = mem[i].port;
+        if(DPMI_CallRealModeRETF(&r) != 0 || (r.w.flags&CPU_CFLAG))
+            break;
+        mem[i].port |= (r.h.bl)<<16; //previously trapped state
+
+        r.w.cs = QEMM_EntryCS;
+        r.w.ip = QEMM_EntryIP;
+        r.w.ax = 0x1A09;
+        r.w.dx = mem[i].port&0xFFFF;
+        if(DPMI_CallRealModeRETF(&r) != 0 || (r.w.flags&CPU_CFLAG)) //set port trapped
+            break;
+        added[i] = !(mem[i].port&0xFFFF0000L);
+    }
+    if(i < count) //failed: restore trap state of ports done so far, installed set unchanged
+    {
+        _LOG("QEMM: trapping port %x failed\n", mem[i].port&0xFFFF);
+        for(int k = 0; k < i; ++k)
+        {
+            if(!added[k])
+                continue;
+            DPMI_REG r = {0};
+            r.w.cs = QEMM_EntryCS;
+            r.w.ip = QEMM_EntryIP;
+            r.w.ax = 0x1A0A; //clear trapped
+            r.w.dx = mem[k].port&0xFFFF;
+            DPMI_CallRealModeRETF(&r);
+        }
+        free(added);
+        free(mem);
+        return FALSE;
+    }
+    free(added);
+
+    QEMM_IODT* old = link->iodt;
+    int oldcount = link->count;
+    CLIS();
+    link->iodt = mem;
+    link->count = count;
+    QEMM_BuildDispatchTable(&QEMM_IODT_header, QEMM_DispatchTable);
+    STIL();
+
+    for(int j = 0; j < oldcount; ++j)
+    {
+        int i = 0;
+        while(i < count && (mem[i].port&0xFFFF) != (old[j].port&0xFFFF))
+            ++i;
+        if(i == count && !(old[j].port&0xFFFF0000L)) //removed & previously not trapped
+        {
+            DPMI_REG r = {0};
+            r.w.cs = QEMM_EntryCS;
+            r.w.ip = QEMM_EntryIP;
+            r.w.ax = 0x1A0A; //clear trapped
+            r.w.dx = old[j].port&0xFFFF;
+            DPMI_CallRealModeRETF(&r);
+        }
+    }
+    free(old);
+    return TRUE;
+}
+
 BOOL QEMM_Uninstall_IOPortTrap(QEMM_IOPT* inputp iopt)
 {
     CLIS();
@@ -261,6 +506,7 @@ BOOL QEMM_Uninstall_IOPortTrap(QEMM_IOPT* inputp iopt)
     if(link->next) link->next->prev = link->prev;
     if(QEMM_IODT_Link == link)
         QEMM_IODT_Link = link->prev;
+    QEMM_BuildDispatchTable(&QEMM_IODT_header, QEMM_DispatchTable);
     STIL();
 
     for(int i = 0; i < link->count; ++i)
@@ -2,6 +2,8 @@
 #define _EMM_H_ 1
 #include <platform.h>
 #include <dpmi/dpmi.h>
+#include <sbemu.h>
+#include <opl3emu.h>
 
 #ifdef __cplusplus
 extern "C"
@@ -11,8 +13,16 @@ extern "C"
 #define QEMM_TF_PM 0x01 //set if in pm, otherwise in rm(v86)
 extern int QEMM_TrapFlags;
 
+//called once per element: string I/O (rep insb/outsb) is decoded by the memory manager (QEMM/QPIEMU/HDPMI) and delivered
+//byte by byte, the callback gets no count or buffer. batching is done in the stubs instead (DSP status, posted OPL writes).
 typedef uint32_t (*QEMM_IOTRAP_HANDLER)(uint32_t port, uint32_t val, uint32_t out);
 
+//access type (CL) of the QEMM callback. QPI documents 00h: in, 04h: out only. string/rep bits as in VMM I/O handlers
+//are not documented for QPI: they're masked off the direction, and recorded to check what the memory manager passes.
+#define QEMM_IOTYPE_STRING 0x10
+#define QEMM_IOTYPE_REP 0x20
+#define QEMM_IOTYPE_DIRMASK ((uint8_t)~(QEMM_IOTYPE_STRING|QEMM_IOTYPE_REP))
+
 //user interface, not actual struct
 typedef struct QEMM_IODispatchTable
 {
@@ -36,6 +46,62 @@ typedef struct QEMM_IODT_LINK
     struct QEMM_IODT_LINK* next; //observer
 }QEMM_IODT_LINK;
 
+#define QEMM_DISPATCH_PORTS 1024 //10 bit ISA ports. flat port=>handler table for faster dispatch
+
+//rebuild dispatch table from links after header, first match wins. higher ports are not in table
+void QEMM_BuildDispatchTable(const QEMM_IODT_LINK* header, QEMM_IOTRAP_HANDLER* table);
+//find handler: table for ports in range, link scan for others
+QEMM_IOTRAP_HANDLER QEMM_FindHandler(const QEMM_IODT_LINK* header, const QEMM_IOTRAP_HANDLER* table, uint32_t port);
+
+#ifndef QEMM_TRAP_STATS
+#define QEMM_TRAP_STATS 0 //count hits & handler cycles per port in both dispatchers, read with INT 2Dh (/STAT). needs RDTSC (586+)
+#endif
+
+//per port trap statistics, for ports in dispatch table. ports answered by the stubs (DSP status, OPL status/index/posted writes) are not counted
+typedef struct
+{
+    uint32_t In;
+    uint32_t Out;
+    uint64_t Cycles; //RDTSC cycles in handler (or pass through of untrapped port), mode switch not included
+}QEMM_TRAPSTAT;
+
+#if QEMM_TRAP_STATS
+extern QEMM_TRAPSTAT QEMM_TrapStats[QEMM_DISPATCH_PORTS];
+static inline void QEMM_AddTrapStat(uint32_t port, uint32_t out, uint64_t cycles)
+{
+    if(port >= QEMM_DISPATCH_PORTS)
+        return;
+    QEMM_TRAPSTAT* stat = &QEMM_TrapStats[port];
+    if(out) ++stat->Out; else ++stat->In;
+    stat->Cycles += cycles;
+}
+#define QEMM_TRAPSTAT_MARK(tsc) uint64_t tsc = PLTFM_RDTSC()
+#define QEMM_TRAPSTAT_ADD(tsc, port, out) QEMM_AddTrapStat(port, out, PLTFM_RDTSC() - (tsc))
+#else
+#define QEMM_TRAPSTAT_MARK(tsc)
+#define QEMM_TRAPSTAT_ADD(tsc, port, out)
+#endif
+//linear address of QEMM_DISPATCH_PORTS stats, 0 if QEMM_TRAP_STATS disabled
+uint32_t QEMM_GetTrapStats(void);
+void QEMM_ResetTrapStats(void);
+//all access type values (CL) seen by the QEMM callback OR'ed together, since last reset. see QEMM_IOTYPE_*
+uint8_t QEMM_GetTrapTypes(void);
+
+//state in DOS memory read by the real mode trap stub, to answer DSP status polls without switching to PM
+typedef struct
+{
+    SBEMU_DSPSTATUS DSP;
+    uint16_t SBPort; //SB base port. 0: disabled
+    uint8_t OPLPost; //queue 389h data writes to QEMM_GetOPLPostRing() instead of calling handler
+}QEMM_SBSTATE;
+
+//linear address of the stub state, 0 if not allocated yet (before first QEMM_Install_IOPortTrap)
+uint32_t QEMM_GetSBState(void);
+//linear address of OPL write ring filled by the stub, 0 if not allocated yet
+uint32_t QEMM_GetOPLPostRing(void);
+//linear address of the stub's primary OPL index latch (1 byte), 0 if not allocated yet
+uint32_t QEMM_GetOPLIndexLatch(void);
+
 //get QEMM version
 uint16_t QEMM_GetVersion(void);
 
@@ -46,6 +112,9 @@ BOOL QEMM_Install_IOPortTrap(QEMM_IODT* inputp iodt, uint16_t count, QEMM_IOPT*
 
 BOOL QEMM_Uninstall_IOPortTrap(QEMM_IOPT* inputp iopt);
 
+//replace an installed set in one step. ports in both old & new set stay trapped
+BOOL QEMM_Swap_IOPortTrap(QEMM_IOPT* inputp iopt, QEMM_IODT* inputp iodt, uint16_t count);
+
 void QEMM_UntrappedIO_Write(uint16_t port, uint8_t value);
 uint8_t QEMM_UntrappedIO_Read(uint16_t port);
 
@@ -92,7 +92,7 @@ static INLINE uint8_t decode_ADPCM_2_sample(uint8_t sample,uint8_t * reference,B
     return *reference;
 }
 
-INLINE uint8_t decode_ADPCM_3_sample(uint8_t sample,uint8_t * reference,Bits* scale) {
+static INLINE uint8_t decode_ADPCM_3_sample(uint8_t sample,uint8_t * reference,Bits* scale) {
     static const int8_t scaleMap[40] = {
         0,  1,  2,  3,  0,  -1,  -2,  -3,
         1,  3,  5,  7, -1,  -3,  -5,  -7,
@@ -203,6 +203,10 @@ void DPMI_DMAFree(void* ptr);
 //allocated memory is 1:1 mapped (physical==linear)
 uint32_t DPMI_DOSMalloc(uint16_t size);
 void DPMI_DOSFree(uint32_t segment);
+//expand ds limit to 4G (__djgpp_nearptr_enable) so that DPMI_L2PTR also works for conventional memory (below ds base),
+//which is 1:1 mapped and can then be accessed in place as near ptr. return FALSE if not supported by the DPMI host.
+//note: not reversible, and any wild pointer then reaches all memory (DOS, other programs) instead of faulting.
+BOOL DPMI_EnableNearLinear(void);
 
 //RM call. return 0 on succeed.
 uint16_t DPMI_CallRealModeRETF(DPMI_REG* reg);
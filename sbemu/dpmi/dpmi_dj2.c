@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <dpmi.h>
 #include <sys/farptr.h>
+#include <sys/nearptr.h>
 #include <sys/segments.h>
 #include <sys/exceptn.h>
 #include <crt0.h>
@@ -21,6 +22,7 @@ static uint32_t DPMI_DSBase = 0;
 static uint32_t DPMI_DSLimit = 0;
 static BOOL DPMI_TSR_Inited = 0;
 static uint16_t DPMI_Selector4G;
+static BOOL DPMI_NearLinear = FALSE;
 
 typedef struct _AddressMap
 {
@@ -45,6 +47,7 @@ static void AddAddressMap(const __dpmi_meminfo* info, uint32_t PhysicalAddr)
             map->LinearAddr = info->address;
             map->PhysicalAddr = PhysicalAddr;
             map->Size = info->size;
+            break;
         }
     }
 }
@@ -318,9 +321,18 @@ uint32_t DPMI_PTR2L(void* ptr)
 
 void* DPMI_L2PTR(uint32_t addr)
 {
+    if(DPMI_NearLinear)
+        return (void*)(addr + __djgpp_conventional_base); //wrap around
     return addr > DPMI_DSBase ? (void*)(addr - DPMI_DSBase) : NULL;
 }
 
+BOOL DPMI_EnableNearLinear(void)
+{
+    if(!DPMI_NearLinear)
+        DPMI_NearLinear = __djgpp_nearptr_enable() != 0; //also sets ds alias limit, interrupt used.
+    return DPMI_NearLinear;
+}
+
 
 uint32_t DPMI_MapMemory(uint32_t physicaladdr, uint32_t size)
 {
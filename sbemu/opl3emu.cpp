@@ -1,3 +1,5 @@
+#include <string.h>
+#include "platform.h"
 #include "opl3emu.h"
 #include "dbopl.h"
 
@@ -12,7 +14,9 @@
 #define OPL3EMU_TIMER1_TIMEOUT OPL3EMU_TIMER1_MASK
 #define OPL3EMU_TIMER2_TIMEOUT OPL3EMU_TIMER2_MASK
 static uint32_t OPL3EMU_TimerCtrlReg[2]; //if start 1 and 2 seperately we will miss one, so use 2 cache
-static uint32_t OPL3EMU_IndexReg[2];
+uint32_t OPL3EMU_IndexReg[2];
+uint8_t OPL3EMU_Status;
+volatile uint8_t* OPL3EMU_IndexLatch;
 
 //secondary index read (Adlib Gold). reference: AIL2.0 source code, dosbox
 #define OPL3EMU_ADLG_IOBUSY 0x40UL
@@ -24,6 +28,12 @@ static uint32_t OPL3EMU_ADLG_CtrlEnable = 0;    //seems not working for Miles So
 static uint32_t OPL3EMU_ADLG_Volume[2] = {0x08,0x08};
 
 static DBOPL::Chip* OPL3EMU_Chip;
+static uint8_t OPL3EMU_Regs[512]; //last written register values, replayed on rate change
+
+OPL3EMU_POSTRING OPL3EMU_PostRing;
+static OPL3EMU_POSTRING* OPL3EMU_PostRings[OPL3EMU_POST_RINGS] = {&OPL3EMU_PostRing};
+static int OPL3EMU_PostRingCount = 1;
+static volatile int OPL3EMU_Flushing;
 
 void OPL3EMU_Init(int samplerate)
 {
@@ -31,6 +41,36 @@ void OPL3EMU_Init(int samplerate)
         delete OPL3EMU_Chip;
     OPL3EMU_Chip = new DBOPL::Chip(true);
     OPL3EMU_Chip->Setup(samplerate);
+    memset(OPL3EMU_Regs, 0, sizeof(OPL3EMU_Regs));
+}
+
+void OPL3EMU_SetRate(int samplerate)
+{
+    if(!OPL3EMU_Chip)
+    {
+        OPL3EMU_Init(samplerate);
+        return;
+    }
+    OPL3EMU_Flush();
+    OPL3EMU_Chip->Setup(samplerate); //clears all registers
+    //OPL3 mode & 4op connections first, they change the meaning of others
+    OPL3EMU_Chip->WriteReg(0x105, OPL3EMU_Regs[0x105]);
+    OPL3EMU_Chip->WriteReg(0x104, OPL3EMU_Regs[0x104]);
+    for(int i = 0; i < 512; ++i)
+    {
+        int reg = i&0xFF;
+        //timer control (04h) is kept by the trap handlers, replaying it would reset IRQ flags/restart timers.
+        //key on (B0h-B8h, BDh rhythm) last, after the channel's operators are set up
+        if(i == 0x105 || i == 0x104 || i == OPL3EMU_TIMER_REG_INDEX || (reg >= 0xB0 && reg <= 0xB8) || i == 0xBD)
+            continue;
+        OPL3EMU_Chip->WriteReg(i, OPL3EMU_Regs[i]);
+    }
+    for(int bank = 0; bank < 0x200; bank += 0x100)
+    {
+        for(int i = 0xB0; i <= 0xB8; ++i)
+            OPL3EMU_Chip->WriteReg(bank+i, OPL3EMU_Regs[bank+i]);
+    }
+    OPL3EMU_Chip->WriteReg(0xBD, OPL3EMU_Regs[0xBD]);
 }
 
 int OPL3EMU_GetMode()
@@ -38,36 +78,89 @@ int OPL3EMU_GetMode()
     return OPL3EMU_Chip->opl3Active;
 }
 
+void OPL3EMU_AddPostRing(OPL3EMU_POSTRING* ring)
+{
+    for(int i = 0; i < OPL3EMU_PostRingCount; ++i)
+    {
+        if(OPL3EMU_PostRings[i] == ring)
+            return;
+    }
+    if(OPL3EMU_PostRingCount < OPL3EMU_POST_RINGS)
+    {
+        ring->Tail = ring->Head; //drop anything queued before
+        OPL3EMU_PostRings[OPL3EMU_PostRingCount++] = ring;
+    }
+}
+
+void OPL3EMU_SetIndexLatch(volatile uint8_t* latch)
+{
+    if(latch)
+        *latch = (uint8_t)OPL3EMU_IndexReg[OPL3EMU_PRIMARY];
+    OPL3EMU_IndexLatch = latch;
+}
+
+void OPL3EMU_Flush()
+{
+    CLIS();
+    if(OPL3EMU_Flushing || !OPL3EMU_Chip) //re-entered from interrupt: the outer one will apply all
+    {
+        STIL();
+        return;
+    }
+    OPL3EMU_Flushing = 1;
+    STIL();
+    for(int i = 0; i < OPL3EMU_PostRingCount; ++i)
+    {
+        OPL3EMU_POSTRING* ring = OPL3EMU_PostRings[i];
+        uint16_t tail = ring->Tail;
+        while(tail != ring->Head)
+        {
+            uint16_t data = ring->Data[tail];
+            OPL3EMU_Regs[data>>8] = (uint8_t)data;
+            OPL3EMU_Chip->WriteReg(data>>8, (uint8_t)data);
+            tail = (tail + 1) & (OPL3EMU_POST_COUNT - 1);
+        }
+        ring->Tail = tail;
+    }
+    OPL3EMU_Flushing = 0;
+}
+
 int OPL3EMU_GenSamples(int16_t* pcm16, int count)
 {
+    OPL3EMU_Flush();
     return OPL3EMU_Chip->Generate(pcm16, count);
 }
 
 uint32_t OPL3EMU_PrimaryRead(uint32_t val)
 {
-    val &= ~0xFF;
-    if ((OPL3EMU_TimerCtrlReg[0] & (OPL3EMU_TIMER1_MASK|OPL3EMU_TIMER1_START)) == OPL3EMU_TIMER1_START)
-        val |= OPL3EMU_TIMER1_TIMEOUT;
-    if ((OPL3EMU_TimerCtrlReg[1] & (OPL3EMU_TIMER2_MASK|OPL3EMU_TIMER2_START)) == OPL3EMU_TIMER2_START)
-        val |= OPL3EMU_TIMER2_TIMEOUT;
-    return val;
+    return (val & ~0xFF) | OPL3EMU_Status;
 }
 
 uint32_t OPL3EMU_PrimaryWriteIndex(uint32_t val)
 {
     OPL3EMU_IndexReg[OPL3EMU_PRIMARY] = OPL3EMU_Chip->WriteAddr(0x388, val);
+    if(OPL3EMU_IndexLatch)
+        *OPL3EMU_IndexLatch = (uint8_t)OPL3EMU_IndexReg[OPL3EMU_PRIMARY];
     return val;
 }
 
 uint32_t OPL3EMU_PrimaryWriteData(uint32_t val)
 {
+    OPL3EMU_Flush(); //keep order with posted writes
     if(OPL3EMU_IndexReg[OPL3EMU_PRIMARY] == OPL3EMU_TIMER_REG_INDEX)
     {
         if(val&(OPL3EMU_TIMER1_START|OPL3EMU_TIMER1_MASK))
             OPL3EMU_TimerCtrlReg[0] = val;
         if(val&(OPL3EMU_TIMER2_START|OPL3EMU_TIMER2_MASK))
             OPL3EMU_TimerCtrlReg[1] = val;
+        //timers expire immediately: status only changes here
+        OPL3EMU_Status = 0;
+        if ((OPL3EMU_TimerCtrlReg[0] & (OPL3EMU_TIMER1_MASK|OPL3EMU_TIMER1_START)) == OPL3EMU_TIMER1_START)
+            OPL3EMU_Status |= OPL3EMU_TIMER1_TIMEOUT;
+        if ((OPL3EMU_TimerCtrlReg[1] & (OPL3EMU_TIMER2_MASK|OPL3EMU_TIMER2_START)) == OPL3EMU_TIMER2_START)
+            OPL3EMU_Status |= OPL3EMU_TIMER2_TIMEOUT;
     }
+    OPL3EMU_Regs[OPL3EMU_IndexReg[OPL3EMU_PRIMARY]&0x1FF] = val;
     OPL3EMU_Chip->WriteReg(OPL3EMU_IndexReg[OPL3EMU_PRIMARY], val);
     return val;
 }
@@ -92,8 +185,10 @@ uint32_t OPL3EMU_SecondaryWriteIndex(uint32_t val)
 
 uint32_t OPL3EMU_SecondaryWriteData(uint32_t val)
 {
+    OPL3EMU_Flush();
     if(/*OPL3EMU_ADLG_CtrlEnable && */(OPL3EMU_IndexReg[OPL3EMU_SECONDARY] == 0x100+OPL3EMU_ADLG_VOLL_REG_INDEX || OPL3EMU_IndexReg[OPL3EMU_SECONDARY] == 0x100+OPL3EMU_ADLG_VOLR_REG_INDEX))
         OPL3EMU_ADLG_Volume[OPL3EMU_IndexReg[OPL3EMU_SECONDARY]-OPL3EMU_ADLG_VOLL_REG_INDEX] = val;
+    OPL3EMU_Regs[OPL3EMU_IndexReg[OPL3EMU_SECONDARY]&0x1FF] = val;
     OPL3EMU_Chip->WriteReg(OPL3EMU_IndexReg[OPL3EMU_SECONDARY], val);
     return val;
 }
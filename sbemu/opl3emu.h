@@ -7,7 +7,36 @@ extern "C"
 {
 #endif
 
+//read/written directly by trap stubs for fast status read & index latch (primary port only)
+extern uint32_t OPL3EMU_IndexReg[2]; //primary, secondary
+extern uint8_t OPL3EMU_Status; //timer flags
+//latch of another stub (i.e. real mode stub in DOS memory) kept equal to the primary index, so there's only one index
+//whichever path (388h, SB 2x8h mirror, PM or RM) wrote it. written by emulation and by the stubs latching OPL3EMU_IndexReg
+extern volatile uint8_t* OPL3EMU_IndexLatch;
+//set the mirrored latch and sync it with current index. NULL: none
+void OPL3EMU_SetIndexLatch(volatile uint8_t* latch);
+
+//posted (write-behind) data writes: trap stubs queue primary data writes without entering emulation,
+//they're applied before generating samples or before any write/read that goes through emulation.
+//single producer (stub) & single consumer: Head only advanced by stub, Tail only by OPL3EMU.
+#define OPL3EMU_POST_COUNT 256 //power of 2, stubs use 8bit wrap
+#define OPL3EMU_POST_RINGS 2
+typedef struct
+{
+    volatile uint16_t Head;
+    volatile uint16_t Tail;
+    volatile uint16_t Data[OPL3EMU_POST_COUNT]; //primary index<<8 | value
+}OPL3EMU_POSTRING;
+
+extern OPL3EMU_POSTRING OPL3EMU_PostRing; //for stubs running in our address space (HDPMI)
+//add ring in other memory (i.e. real mode stub in DOS memory). ignored if already added
+void OPL3EMU_AddPostRing(OPL3EMU_POSTRING* ring);
+//apply posted writes to chip
+void OPL3EMU_Flush();
+
 void OPL3EMU_Init(int samplerate);
+//change output rate, keeping the register state set by client
+void OPL3EMU_SetRate(int samplerate);
 //get mode set by client. 0: OPL2, other:OPL3
 int OPL3EMU_GetMode();
 int OPL3EMU_GenSamples(int16_t* pcm16, int count);
@@ -19,6 +19,32 @@
 #define CLIS()
 #define STIL()
 
+//shadow IMRs: real data ports are read only if the shadow is not valid, and written only on change.
+static BOOL PIC_Shadowing;
+static uint8_t PIC_ShadowValid; //bit0: master, bit1: slave. never set if not shadowing
+static uint8_t PIC_IMR[2];
+
+static uint8_t PIC_ReadIMR(int index)
+{
+    if(!(PIC_ShadowValid&(1<<index)))
+    {
+        PIC_IMR[index] = inp(index ? PIC_DATA2 : PIC_DATA1);
+        if(PIC_Shadowing)
+            PIC_ShadowValid |= (uint8_t)(1<<index);
+    }
+    return PIC_IMR[index];
+}
+
+static void PIC_WriteIMR(int index, uint8_t mask)
+{
+    if((PIC_ShadowValid&(1<<index)) && PIC_IMR[index] == mask)
+        return;
+    outp(index ? PIC_DATA2 : PIC_DATA1, mask);
+    PIC_IMR[index] = mask;
+    if(PIC_Shadowing)
+        PIC_ShadowValid |= (uint8_t)(1<<index);
+}
+
 void PIC_SendEOIWithIRQ(uint8_t irq)
 {
     if(irq == 7 || irq == 15) //check spurious irq
@@ -67,7 +93,7 @@ uint8_t PIC_GetIRQ(void)
 void PIC_RemapMaster(uint8_t vector)
 {
     CLIS();
-    uint8_t oldmask = inp(PIC_DATA1);
+    uint8_t oldmask = PIC_ReadIMR(0);
     outp(PIC_PORT1, 0x11);
     outp(PIC_DATA1, vector);
     outp(PIC_DATA1, 4);
@@ -79,7 +105,7 @@ void PIC_RemapMaster(uint8_t vector)
 void PIC_RemapSlave(uint8_t vector)
 {
     CLIS();
-    uint8_t oldmask = inp(PIC_DATA2);
+    uint8_t oldmask = PIC_ReadIMR(1);
     outp(PIC_PORT2, 0x11);
     outp(PIC_DATA2, vector);
     outp(PIC_DATA2, 2);
@@ -90,37 +116,30 @@ void PIC_RemapSlave(uint8_t vector)
 
 void PIC_MaskIRQ(uint8_t irq)
 {
-    uint16_t port = PIC_DATA1;
-    if(irq >= 8)
-    {
-        port = PIC_DATA2;
-        irq = (uint8_t)(irq - 8);
-    }
+    int index = irq >= 8;
     CLIS();
-    outp(port, (uint8_t)(inp(port)|(1<<irq)));
+    PIC_WriteIMR(index, (uint8_t)(PIC_ReadIMR(index)|(1<<(irq&0x7))));
     STIL();
 }
 
 void PIC_UnmaskIRQ(uint8_t irq)
 {
-    uint16_t port = PIC_DATA1;
-    CLIS();    
+    CLIS();
     if(irq >= 8)
     {
-        uint8_t master = inp(port);
+        uint8_t master = PIC_ReadIMR(0);
         if(master&0x4)
-            outp(port, (uint8_t)(master&~0x4)); //unmask slave
-        port = PIC_DATA2;
-        irq = (uint8_t)(irq - 8);
+            PIC_WriteIMR(0, (uint8_t)(master&~0x4)); //unmask slave
     }
-    outp(port, (uint8_t)(inp(port)&~(1<<irq)));
+    int index = irq >= 8;
+    PIC_WriteIMR(index, (uint8_t)(PIC_ReadIMR(index)&~(1<<(irq&0x7))));
     STIL();
 }
 
 uint16_t PIC_GetIRQMask(void)
 {
     CLIS();
-    uint16_t mask = (uint16_t)((inp(PIC_DATA2)<<8) | inp(PIC_DATA1));
+    uint16_t mask = (uint16_t)((PIC_ReadIMR(1)<<8) | PIC_ReadIMR(0));
     STIL();
     return mask;
 }
@@ -128,7 +147,18 @@ uint16_t PIC_GetIRQMask(void)
 void PIC_SetIRQMask(uint16_t mask)
 {
     CLIS();
-    outp(PIC_DATA1, (uint8_t)mask);
-    outp(PIC_DATA2, (uint8_t)(mask>>8));
+    PIC_WriteIMR(0, (uint8_t)mask);
+    PIC_WriteIMR(1, (uint8_t)(mask>>8));
     STIL();
 }
+
+void PIC_ShadowIRQMask(BOOL enable)
+{
+    PIC_Shadowing = enable;
+    PIC_ShadowValid = 0;
+}
+
+void PIC_InvalidateIRQMask(void)
+{
+    PIC_ShadowValid = 0;
+}
@@ -43,6 +43,13 @@ uint16_t PIC_GetIRQMask(void);
 
 void PIC_SetIRQMask(uint16_t mask);
 
+//keep shadow copies of both IMRs and skip writes that don't change them. only valid if every other write to the
+//PIC ports is reported with PIC_InvalidateIRQMask (i.e. trapped in all modes). disabled by default
+void PIC_ShadowIRQMask(BOOL enable);
+
+//PIC written by others (guest write seen in a trap): re-read IMRs on next use
+void PIC_InvalidateIRQMask(void);
+
 #define PIC_IS_IRQ_MASKED(mask, irq) (((mask)&(1<<(irq))))
 #define PIC_IRQ_MASK(mask, irq) (((mask)|(1<<(irq))))
 #define PIC_IRQ_UNMASK(mask, irq) (((mask)&(~(1<<(irq)))))
@@ -102,6 +102,21 @@ static uint32_t PLTFM_BSF(uint32_t x) { uint32_t i; __asm {bsf eax, x; mov i, ea
 static inline uint32_t PLTFM_BSF(uint32_t x) {uint32_t i; asm("bsf %1, %0" : "=r" (i) : "rm" (x)); return i;} //386+
 static inline uint16_t PLTFM_CPU_FLAGS_ASM(void) { uint32_t flags = 0; asm("pushf\n\t" "pop %0\n\t" : "=r"(flags)); return (uint16_t)flags; }
 static inline uint16_t PLTFM_CPU_FLAGS() { uint16_t (* volatile VFN)(void) = &PLTFM_CPU_FLAGS_ASM; return VFN();} //prevent optimization, need get FLAGS every time
+static inline uint64_t PLTFM_RDTSC() { uint64_t tsc; asm __volatile__("rdtsc" : "=A"(tsc)); return tsc; } //586+
+//regs: eax,ebx,ecx,edx of CPUID 'leaf'. return 0 if no CPUID (386/early 486) or leaf not supported
+static inline int PLTFM_CPUID(uint32_t leaf, uint32_t regs[4])
+{
+    uint32_t f1, f2;
+    asm("pushfl\n\t" "popl %0\n\t" "movl %0,%1\n\t" "xorl $0x200000,%0\n\t" "pushl %0\n\t" "popfl\n\t" "pushfl\n\t" "popl %0\n\t" "pushl %1\n\t" "popfl\n\t"
+        :"=&r"(f1),"=&r"(f2));
+    if(!((f1^f2)&0x200000)) //EFLAGS.ID not writable
+        return 0;
+    asm("cpuid":"=a"(regs[0]),"=b"(regs[1]),"=c"(regs[2]),"=d"(regs[3]):"a"(leaf&0x80000000));
+    if(regs[0] < leaf)
+        return 0;
+    asm("cpuid":"=a"(regs[0]),"=b"(regs[1]),"=c"(regs[2]),"=d"(regs[3]):"a"(leaf));
+    return 1;
+}
 
 #define memcpy_c2d memcpy
 
@@ -170,11 +185,17 @@ static inline uint16_t PLTFM_CPU_FLAGS() { uint16_t (* volatile VFN)(void) = &PL
 #define _ASM_SGDT(x) 
 
 //not defined
+#ifdef __cplusplus
+extern "C"
+{
+#endif
 extern void NOP();
 extern void CLI();
 extern void STI();
 extern uint32_t PLTFM_BSF(uint32_t x);
 extern uint16_t PLTFM_CPU_FLAGS(void);
+extern uint64_t PLTFM_RDTSC(void);
+extern int PLTFM_CPUID(uint32_t leaf, uint32_t regs[4]);
 
 extern void delay(int);
 extern uint8_t inp(uint16_t port);
@@ -186,6 +207,9 @@ extern void outpd(uint16_t port, uint32_t val);
 extern int _dos_open(const char* file, int mode, int* fd);
 extern int _dos_close(int fd);
 extern int ioctl(int, int, int, void*);
+#ifdef __cplusplus
+}
+#endif
 
 #define DOS_RCVDATA 2
 #define DOS_SNDDATA 3
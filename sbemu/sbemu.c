@@ -11,6 +11,16 @@ typedef struct
     uint8_t useRef;
 }ADPCM_STATE;
 
+//decoding table entry for one input byte: reference deltas of each sample in it, and next step state
+typedef struct
+{
+    int8_t delta[4];
+    uint8_t next;
+}ADPCM_ENTRY;
+
+#define SBEMU_ADPCM_MAXSTATES 6 //steps: 2bit: 0~20 by 4, 3bit: 0~32 by 8, 4bit: 0~48 by 16
+#define SBEMU_ADPCM_MAXDELTA 64 //max reference delta per sample is 60
+
 //internal cmds
 #define SBEMU_DSPCMD_INVALID -1
 #define SBEMU_DSPCMD_SKIP1 -2
@@ -21,7 +31,13 @@ typedef struct
 #define SBEMU_RESET_END 1
 #define SBEMU_RESET_POLL 2
 
-#define SBEMU_DELAY_FOR_IRQ for(volatile int i = 0; i < 0xFFFFFFF; ++i) NOP()
+//deferred virtual IRQs (DSP F2h/F3h): queued by the trap handler, raised from the card interrupt once due
+#define SBEMU_EVENT_MAX 4
+typedef struct
+{
+    uint64_t due;   //TSC, 0: next service
+    uint8_t intsts; //SBEMU_MIXERREG_INT_STS bits set when raised
+}SBEMU_EVENT;
 
 SBEMU_EXTFUNS* SBEMU_ExtFuns;
 static int SBEMU_ResetState = SBEMU_RESET_END;
@@ -38,7 +54,9 @@ static int SBEMU_HighSpeed = 0;
 static int SBEMU_DSPCMD = SBEMU_DSPCMD_INVALID;
 static int SBEMU_DSPCMD_Subindex = 0;
 static int SBEMU_DSPDATA_Subindex = 0;
-static int SBEMU_TriggerIRQ = 0;
+static SBEMU_EVENT SBEMU_Events[SBEMU_EVENT_MAX]; //in due order: delay is constant
+static int SBEMU_EventCount = 0;
+static uint32_t SBEMU_IRQDelayCycles = 0;
 static int SBEMU_Pos = 0;
 static int SBEMU_DetectionCounter = 0;
 static int SBEMU_DirectCount = 0;
@@ -46,19 +64,24 @@ static int SBEMU_UseTimeConst = 0;
 static uint8_t SBEMU_IRQMap[4] = {2,5,7,10};
 static uint8_t SBEMU_MixerRegIndex = 0;
 static uint8_t SBEMU_idbyte;
-static uint8_t SBEMU_WS;
-static uint8_t SBEMU_RS = 0x2A;
+static SBEMU_DSPSTATUS SBEMU_DSPStatusLocal = {0, 0x2A, 0, SBEMU_WS_TOGGLE, 0};
+static uint32_t SBEMU_WSBusyCycles;
+static SBEMU_DSPSTATUS* SBEMU_DSPStatus = &SBEMU_DSPStatusLocal;
 static uint8_t SBEMU_TestReg;
 static uint8_t SBEMU_DMAID_A;
 static uint8_t SBEMU_DMAID_X;
 static uint16_t SBEMU_DSPVER = 0x0302;
 static ADPCM_STATE SBEMU_ADPCM;
+static ADPCM_ENTRY SBEMU_ADPCMTable[SBEMU_ADPCM_MAXSTATES][256]; //[step state][input byte], for current bits
+static uint8_t SBEMU_ADPCMClamp[256+SBEMU_ADPCM_MAXDELTA*2]; //[ref+delta+SBEMU_ADPCM_MAXDELTA] => saturated ref
+static int SBEMU_ADPCMTableBits = 0;
+static SBEMU_CONVERT_FUNC SBEMU_Converter;
 
 static int SBEMU_TimeConstantMapMono[][2] =
 {
-    0xA5, 11025,
-    0xD2, 22050,
-    0xE9, 44100,
+    {0xA5, 11025},
+    {0xD2, 22050},
+    {0xE9, 44100},
 };
 static uint8_t SBEMU_Copyright[] = "COPYRIGHT (C) CREATIVE TECHNOLOGY LTD, 1992.";
 
@@ -76,6 +99,162 @@ static int SBEMU_Indexof(uint8_t* array, int count, uint8_t  val)
     return -1;
 }
 
+//sample bits of ADPCM output commands. commands are not ordered by bits (i.e. 2bit auto 0x1F)
+static int SBEMU_ADPCMBits(int cmd)
+{
+    switch(cmd)
+    {
+        case SBEMU_CMD_2BIT_OUT_1: case SBEMU_CMD_2BIT_OUT_1_NREF: case SBEMU_CMD_2BIT_OUT_AUTO:
+            return 2;
+        case SBEMU_CMD_3BIT_OUT_1: case SBEMU_CMD_3BIT_OUT_1_NREF: case SBEMU_CMD_3BIT_OUT_AUTO:
+            return 3;
+        default:
+            return 4;
+    }
+}
+
+//DMA converters: guest DMA bytes to 16bit stereo frames in a single pass. return frames written
+static __INLINE int16_t* SBEMU_PutPCM8(int16_t* pcm, uint8_t sample)
+{
+    pcm[0] = pcm[1] = (int16_t)(((int)sample - 128) << 8);
+    return pcm + 2;
+}
+
+static int SBEMU_Convert_PCM8Mono(int16_t* pcm, const uint8_t* src, int bytes)
+{
+    for(int i = 0; i < bytes; ++i)
+        pcm = SBEMU_PutPCM8(pcm, src[i]);
+    return bytes;
+}
+
+static int SBEMU_Convert_PCM8Stereo(int16_t* pcm, const uint8_t* src, int bytes)
+{
+    int count = bytes / 2;
+    for(int i = 0; i < count*2; ++i)
+        pcm[i] = (int16_t)(((int)src[i] - 128) << 8);
+    return count;
+}
+
+static int SBEMU_Convert_PCM16Mono(int16_t* pcm, const uint8_t* src, int bytes)
+{
+    int count = bytes / 2;
+    const int16_t* src16 = (const int16_t*)src;
+    for(int i = 0; i < count; ++i)
+        pcm[i*2] = pcm[i*2+1] = src16[i];
+    return count;
+}
+
+static int SBEMU_Convert_PCM16Stereo(int16_t* pcm, const uint8_t* src, int bytes)
+{
+    int count = bytes / 4;
+    memcpy(pcm, src, count*4);
+    return count;
+}
+
+static int SBEMU_ADPCM_Start(const uint8_t* adpcm)
+{
+    if(!SBEMU_ADPCM.useRef)
+        return 0;
+    SBEMU_ADPCM.useRef = FALSE;
+    SBEMU_ADPCM.ref = *adpcm;
+    SBEMU_ADPCM.step = 0;
+    return 1;
+}
+
+//build decoding tables from the per sample decoders in ctadpcm.h, so results are identical
+static void SBEMU_ADPCM_BuildTable(int bits)
+{
+    const int unit = bits == 2 ? 4 : (bits == 3 ? 8 : 16); //step increment
+    const int states = bits == 2 ? 6 : (bits == 3 ? 5 : 4);
+    for(int state = 0; state < states; ++state)
+    {
+        for(int b = 0; b < 256; ++b)
+        {
+            uint8_t codes[4];
+            int count;
+            if(bits == 2)
+            {
+                codes[0] = (b >> 6) & 0x3; codes[1] = (b >> 4) & 0x3; codes[2] = (b >> 2) & 0x3; codes[3] = b & 0x3;
+                count = 4;
+            }
+            else if(bits == 3)
+            {
+                codes[0] = (b >> 5) & 0x7; codes[1] = (b >> 2) & 0x7; codes[2] = (b & 0x3) << 1;
+                count = 3;
+            }
+            else
+            {
+                codes[0] = b >> 4; codes[1] = b & 0xF;
+                count = 2;
+            }
+            ADPCM_ENTRY* entry = &SBEMU_ADPCMTable[state][b];
+            Bits step = state * unit;
+            for(int k = 0; k < count; ++k)
+            {
+                uint8_t ref = 128; //no saturation for a single delta
+                uint8_t out = bits == 2 ? decode_ADPCM_2_sample(codes[k], &ref, &step) : (bits == 3 ? decode_ADPCM_3_sample(codes[k], &ref, &step) : decode_ADPCM_4_sample(codes[k], &ref, &step));
+                entry->delta[k] = (int8_t)((int)out - 128);
+            }
+            entry->next = (uint8_t)(step / unit);
+        }
+    }
+    for(int i = 0; i < 256+SBEMU_ADPCM_MAXDELTA*2; ++i)
+        SBEMU_ADPCMClamp[i] = (uint8_t)max(0, min(255, i - SBEMU_ADPCM_MAXDELTA));
+    SBEMU_ADPCMTableBits = bits;
+}
+
+//decode whole bytes (samples per byte: 8/bits, rounded down) with one table lookup per byte
+static __INLINE int SBEMU_ADPCM_Decode(int16_t* pcm, const uint8_t* src, int bytes, int samples, int unit)
+{
+    int16_t* start = pcm;
+    int i = SBEMU_ADPCM_Start(src);
+    int ref = SBEMU_ADPCM.ref;
+    int state = min(SBEMU_ADPCM.step / unit, SBEMU_ADPCM_MAXSTATES-1);
+    for(; i < bytes; ++i)
+    {
+        const ADPCM_ENTRY* entry = &SBEMU_ADPCMTable[state][src[i]];
+        for(int k = 0; k < samples; ++k)
+        {
+            ref = SBEMU_ADPCMClamp[ref + entry->delta[k] + SBEMU_ADPCM_MAXDELTA];
+            pcm = SBEMU_PutPCM8(pcm, (uint8_t)ref);
+        }
+        state = entry->next;
+    }
+    SBEMU_ADPCM.ref = (uint8_t)ref;
+    SBEMU_ADPCM.step = state * unit;
+    return (pcm - start) / 2;
+}
+
+static int SBEMU_Convert_ADPCM2(int16_t* pcm, const uint8_t* src, int bytes)
+{
+    return SBEMU_ADPCM_Decode(pcm, src, bytes, 4, 4);
+}
+
+static int SBEMU_Convert_ADPCM3(int16_t* pcm, const uint8_t* src, int bytes)
+{
+    return SBEMU_ADPCM_Decode(pcm, src, bytes, 3, 8);
+}
+
+static int SBEMU_Convert_ADPCM4(int16_t* pcm, const uint8_t* src, int bytes)
+{
+    return SBEMU_ADPCM_Decode(pcm, src, bytes, 2, 16);
+}
+
+//select converter on format change, instead of checking format on every interrupt
+static void SBEMU_UpdateConverter()
+{
+    if(SBEMU_Bits < 8 && SBEMU_ADPCMTableBits != SBEMU_Bits)
+        SBEMU_ADPCM_BuildTable(SBEMU_Bits);
+    switch(SBEMU_Bits)
+    {
+        case 2: SBEMU_Converter = &SBEMU_Convert_ADPCM2; break;
+        case 3: SBEMU_Converter = &SBEMU_Convert_ADPCM3; break;
+        case 4: SBEMU_Converter = &SBEMU_Convert_ADPCM4; break;
+        case 16: SBEMU_Converter = SBEMU_GetChannels() == 2 ? &SBEMU_Convert_PCM16Stereo : &SBEMU_Convert_PCM16Mono; break;
+        default: SBEMU_Converter = SBEMU_GetChannels() == 2 ? &SBEMU_Convert_PCM8Stereo : &SBEMU_Convert_PCM8Mono; break;
+    }
+}
+
 
 void SBEMU_Mixer_WriteAddr(int16_t port, uint8_t value)
 {
@@ -131,6 +310,18 @@ void SBEMU_Mixer_Write(uint16_t port, uint8_t value)
             }
         }
     }
+    if(SBEMU_MixerRegIndex == SBEMU_MIXERREG_MODEFILTER)
+        SBEMU_UpdateConverter(); //stereo bit
+    if(SBEMU_MixerRegIndex == SBEMU_MIXERREG_INT_STS)
+        SBEMU_DSPStatus->IntPending = SBEMU_MixerRegs[SBEMU_MIXERREG_INT_STS]&0x1;
+    switch(SBEMU_MixerRegIndex)
+    {
+        case SBEMU_MIXERREG_RESET: case SBEMU_MIXERREG_MASTERVOL: case SBEMU_MIXERREG_MIDIVOL: case SBEMU_MIXERREG_VOICEVOL:
+        case SBEMU_MIXERREG_MASTERSTEREO: case SBEMU_MIXERREG_MIDISTEREO: case SBEMU_MIXERREG_VOICESTEREO:
+        case SBEMU_MIXRREG_MASTERL: case SBEMU_MIXRREG_MASTERR: case SBEMU_MIXRREG_VOICEL: case SBEMU_MIXRREG_VOICER: case SBEMU_MIXRREG_MIDIL: case SBEMU_MIXRREG_MIDIR:
+            if(SBEMU_ExtFuns && SBEMU_ExtFuns->MixerChanged)
+                SBEMU_ExtFuns->MixerChanged();
+    }
     if(SBEMU_MixerRegIndex == SBEMU_MIXERREG_MODEFILTER && SBEMU_UseTimeConst)
     {
         //divide channels: channels might be set later than time const, order opposite to the SB programming guide. (Game: Epic Pinball)
@@ -164,13 +355,16 @@ void SBEMU_DSP_Reset(uint16_t port, uint8_t value)
         SBEMU_Bits = 8;
         SBEMU_Pos = 0;
         SBEMU_HighSpeed = 0;
-        SBEMU_TriggerIRQ = 0;
+        CLIS(); //queue is serviced from card/timer interrupt
+        SBEMU_EventCount = 0;
+        STIL();
         SBEMU_DetectionCounter = 0;
         SBEMU_DirectCount = 0;
         SBEMU_DirectBuffer[0] = 0;
         SBEMU_DMAID_A = 0xAA;
         SBEMU_DMAID_X = 0x96;
         SBEMU_UseTimeConst = 0;
+        SBEMU_UpdateConverter();
 
         //SBEMU_Mixer_WriteAddr(0, SBEMU_MIXERREG_RESET);
         //SBEMU_Mixer_Write(0, 1);
@@ -179,9 +373,29 @@ void SBEMU_DSP_Reset(uint16_t port, uint8_t value)
         SBEMU_ResetState = SBEMU_RESET_POLL;
 }
 
+//called from trap handler: card interrupt may come in between
+static void SBEMU_QueueIRQ(uint8_t intsts)
+{
+    uint64_t due = SBEMU_IRQDelayCycles ? PLTFM_RDTSC() + SBEMU_IRQDelayCycles : 0;
+    CLIS();
+    if(SBEMU_EventCount < SBEMU_EVENT_MAX)
+    {
+        SBEMU_Events[SBEMU_EventCount].due = due;
+        SBEMU_Events[SBEMU_EventCount++].intsts = intsts;
+    }
+    else //IRQs in flight merge on the line anyway
+        SBEMU_Events[SBEMU_EventCount-1].intsts |= intsts;
+    STIL();
+}
+
 void SBEMU_DSP_Write(uint16_t port, uint8_t value)
 {
     _LOG("SBEMU: DSP write %02x, original: %02x\n", value, SBEMU_DSPCMD);
+    if(SBEMU_DSPStatus->WSPolicy == SBEMU_WS_TIMED)
+    {
+        SBEMU_DSPStatus->WSReady = PLTFM_RDTSC() + SBEMU_WSBusyCycles;
+        SBEMU_DSPStatus->WS |= 0x80;
+    }
     if(SBEMU_HighSpeed) //highspeed won't accept further commands, need reset
         return;
     int OldStarted = SBEMU_Started;
@@ -194,11 +408,9 @@ void SBEMU_DSP_Write(uint16_t port, uint8_t value)
             case SBEMU_CMD_TRIGGER_IRQ:
             case SBEMU_CMD_TRIGGER_IRQ16:
             {
-                SBEMU_MixerRegs[SBEMU_MIXERREG_INT_STS] |= SBEMU_DSPCMD == SBEMU_CMD_TRIGGER_IRQ ? 0x1 : 0x2;
-                SBEMU_TriggerIRQ = 1;
+                SBEMU_QueueIRQ(SBEMU_DSPCMD == SBEMU_CMD_TRIGGER_IRQ ? 0x1 : 0x2);
                 SBEMU_DSPCMD = SBEMU_DSPCMD_INVALID;
                 //SBEMU_ExtFuns->RaiseIRQ(SBEMU_GetIRQ());
-                SBEMU_DELAY_FOR_IRQ; //hack: add CPU delay so that sound interrupt raises virtual IRQ when games handler is installed (timing issue)
             }
             break;
             case SBEMU_CMD_DAC_SPEAKER_ON:
@@ -230,6 +442,7 @@ void SBEMU_DSP_Write(uint16_t port, uint8_t value)
                 SBEMU_Started = TRUE; //start transfer
                 SBEMU_DSPCMD = SBEMU_DSPCMD_INVALID;
                 SBEMU_Pos = 0;
+                SBEMU_UpdateConverter();
             }
             break;
             case SBEMU_CMD_2BIT_OUT_AUTO:
@@ -239,11 +452,12 @@ void SBEMU_DSP_Write(uint16_t port, uint8_t value)
                 SBEMU_Auto = TRUE;
                 SBEMU_ADPCM.useRef = TRUE;
                 SBEMU_ADPCM.step = 0;
-                SBEMU_Bits = (SBEMU_DSPCMD<=SBEMU_CMD_2BIT_OUT_1_NREF) ? 2 : (SBEMU_DSPCMD>=SBEMU_CMD_3BIT_OUT_1_NREF) ? 3 : 4;
+                SBEMU_Bits = SBEMU_ADPCMBits(SBEMU_DSPCMD);
                 SBEMU_MixerRegs[SBEMU_MIXERREG_MODEFILTER] &= ~0x2;
                 SBEMU_Started = TRUE; //start transfer here
                 SBEMU_DSPCMD = SBEMU_DSPCMD_INVALID;
                 SBEMU_Pos = 0;
+                SBEMU_UpdateConverter();
             }
             break;
             case SBEMU_CMD_EXIT_16BIT_AUTO:
@@ -306,6 +520,7 @@ void SBEMU_DSP_Write(uint16_t port, uint8_t value)
                     {
                         SBEMU_Bits = 8;
                         SBEMU_Pos = 0;
+                        SBEMU_UpdateConverter();
                     }
                 }
             }
@@ -325,10 +540,11 @@ void SBEMU_DSP_Write(uint16_t port, uint8_t value)
                     SBEMU_Auto = FALSE;
                     SBEMU_ADPCM.useRef = (SBEMU_DSPCMD==SBEMU_CMD_2BIT_OUT_1 || SBEMU_DSPCMD==SBEMU_CMD_3BIT_OUT_1 || SBEMU_DSPCMD==SBEMU_CMD_4BIT_OUT_1);
                     SBEMU_ADPCM.step = 0;
-                    SBEMU_Bits = (SBEMU_DSPCMD<=SBEMU_CMD_2BIT_OUT_1_NREF) ? 2 : (SBEMU_DSPCMD>=SBEMU_CMD_3BIT_OUT_1_NREF) ? 3 : 4;
+                    SBEMU_Bits = SBEMU_ADPCMBits(SBEMU_DSPCMD);
                     SBEMU_MixerRegs[SBEMU_MIXERREG_MODEFILTER] &= ~0x2;
                     SBEMU_Started = TRUE; //start transfer here
                     SBEMU_Pos = 0;
+                    SBEMU_UpdateConverter();
                 }
             }
             break;
@@ -374,6 +590,7 @@ void SBEMU_DSP_Write(uint16_t port, uint8_t value)
                     SBEMU_MixerRegs[SBEMU_MIXERREG_MODEFILTER] |= (SBEMU_DSPCMD==SBEMU_CMD_MODE_PCM8_STEREO || SBEMU_DSPCMD==SBEMU_CMD_MODE_PCM16_STEREO) ? 0x2 : 0;
                     SBEMU_Started = TRUE; //start transfer here
                     SBEMU_Pos = 0;
+                    SBEMU_UpdateConverter();
                 }
             }
             break;
@@ -426,12 +643,7 @@ void SBEMU_DSP_Write(uint16_t port, uint8_t value)
             STIL();
         }*/
 
-        if(SBEMU_GetSampleBytes() <= 32 && SBEMU_ExtFuns->DMA_Size(SBEMU_GetDMA()) <= 32) //small buffer, probably a detection routine
-        {
-            //SBEMU_ExtFuns->RaiseIRQ(SBEMU_GetIRQ());
-            //SBEMU_Started = FALSE;
-            SBEMU_DELAY_FOR_IRQ; //hack: add CPU delay so that sound interrupt raises virtual IRQ when games handler is installed (timing issue)
-        }
+        //small buffer (<=32 bytes) is probably a detection routine: its IRQ comes from the transfer on next card interrupt, like any other block
     }
 }
 
@@ -486,16 +698,35 @@ uint8_t SBEMU_DSP_WriteStatus(uint16_t port)
 {
     _LOG("SBEMU: DSP WS\n");
     //return 0; //ready for write (bit7 clear)
-    SBEMU_WS += 0x80; //some games will wait on busy first
-    return SBEMU_WS;
+    if(SBEMU_DSPStatus->WSPolicy == SBEMU_WS_TOGGLE)
+        SBEMU_DSPStatus->WS += 0x80; //some games will wait on busy first
+    else if((SBEMU_DSPStatus->WS&0x80) && (int64_t)(PLTFM_RDTSC() - SBEMU_DSPStatus->WSReady) >= 0)
+        SBEMU_DSPStatus->WS &= ~0x80; //timed: busy expired. ready policy never sets it
+    return SBEMU_DSPStatus->WS;
 }
 
 uint8_t SBEMU_DSP_ReadStatus(uint16_t port)
 {
     _LOG("SBEMU: DSP RS\n");
-    SBEMU_RS += 0x80;
+    SBEMU_DSPStatus->RS += 0x80;
     SBEMU_MixerRegs[SBEMU_MIXERREG_INT_STS] &= ~0x1;
-    return SBEMU_RS;
+    SBEMU_DSPStatus->IntPending = 0;
+    return SBEMU_DSPStatus->RS;
+}
+
+void SBEMU_SetDSPStatus(SBEMU_DSPSTATUS* status)
+{
+    if(status == NULL)
+        status = &SBEMU_DSPStatusLocal;
+    *status = *SBEMU_DSPStatus;
+    SBEMU_DSPStatus = status;
+}
+
+void SBEMU_SetWSPolicy(int policy, uint32_t busycycles)
+{
+    SBEMU_DSPStatus->WSPolicy = (uint8_t)policy;
+    SBEMU_DSPStatus->WS &= ~0x80;
+    SBEMU_WSBusyCycles = busycycles;
 }
 
 uint8_t SBEMU_DSP_INT16ACK(uint16_t port)
@@ -511,6 +742,7 @@ void SBEMU_Init(int irq, int dma, int hdma, int DSPVer, SBEMU_EXTFUNS* extfuns)
     SBEMU_HDMA = hdma;
     SBEMU_DSPVER = DSPVer;
     SBEMU_ExtFuns = extfuns;
+    SBEMU_UpdateConverter();
 
     SBEMU_Mixer_WriteAddr(0, SBEMU_MIXERREG_RESET);
     SBEMU_Mixer_Write(0, 1);
@@ -592,17 +824,35 @@ int SBEMU_GetPos()
 int SBEMU_SetPos(int pos)
 {
     if(pos >= SBEMU_GetSampleBytes())
+    {
         SBEMU_MixerRegs[SBEMU_MIXERREG_INT_STS] |= SBEMU_GetBits() <= 8 ? 0x01 : 0x02;
+        SBEMU_DSPStatus->IntPending = SBEMU_MixerRegs[SBEMU_MIXERREG_INT_STS]&0x1;
+    }
     return SBEMU_Pos = pos;
 }
 
-int SBEMU_IRQTriggered()
+void SBEMU_SetIRQDelay(uint32_t cycles)
 {
-    return SBEMU_TriggerIRQ;
+    SBEMU_IRQDelayCycles = cycles;
 }
-void SBEMU_SetIRQTriggered(int triggered)
+
+int SBEMU_ServiceEvents(uint64_t now)
 {
-    SBEMU_TriggerIRQ = triggered;
+    int raised = 0;
+    CLIS();
+    while(raised < SBEMU_EventCount && SBEMU_Events[raised].due <= now)
+    {
+        SBEMU_MixerRegs[SBEMU_MIXERREG_INT_STS] |= SBEMU_Events[raised].intsts;
+        ++raised;
+    }
+    if(raised)
+    {
+        SBEMU_DSPStatus->IntPending = SBEMU_MixerRegs[SBEMU_MIXERREG_INT_STS]&0x1;
+        SBEMU_EventCount -= raised;
+        memmove(SBEMU_Events, SBEMU_Events+raised, SBEMU_EventCount*sizeof(SBEMU_EVENT));
+    }
+    STIL();
+    return raised;
 }
 
 uint8_t SBEMU_GetMixerReg(uint8_t index)
@@ -610,47 +860,15 @@ uint8_t SBEMU_GetMixerReg(uint8_t index)
     return SBEMU_MixerRegs[index];
 }
 
-int SBEMU_DecodeADPCM(uint8_t* adpcm, int bytes)
+SBEMU_CONVERT_FUNC SBEMU_GetConverter()
 {
-    int start = 0;
-    if(SBEMU_ADPCM.useRef)
-    {
-        SBEMU_ADPCM.useRef = FALSE;
-        SBEMU_ADPCM.ref = *adpcm;
-        SBEMU_ADPCM.step = 0;
-        ++start;
-    }
-
-    int outbytes = bytes * (9/SBEMU_Bits);
-    uint8_t* pcm = (uint8_t*)malloc(outbytes);
-    int outcount = 0;
+    return SBEMU_Converter;
+}
 
-    for(int i = start; i < bytes; ++i)
-    {
-        if(SBEMU_Bits == 2)
-        {
-            pcm[outcount++]=decode_ADPCM_2_sample((adpcm[i] >> 6) & 0x3,&SBEMU_ADPCM.ref,&SBEMU_ADPCM.step);
-            pcm[outcount++]=decode_ADPCM_2_sample((adpcm[i] >> 4) & 0x3,&SBEMU_ADPCM.ref,&SBEMU_ADPCM.step);
-            pcm[outcount++]=decode_ADPCM_2_sample((adpcm[i] >> 2) & 0x3,&SBEMU_ADPCM.ref,&SBEMU_ADPCM.step);
-            pcm[outcount++]=decode_ADPCM_2_sample((adpcm[i] >> 0) & 0x3,&SBEMU_ADPCM.ref,&SBEMU_ADPCM.step);
-        }
-        else if(SBEMU_Bits == 3)
-        {
-            pcm[outcount++]=decode_ADPCM_3_sample((adpcm[i] >> 5) & 0x7,&SBEMU_ADPCM.ref,&SBEMU_ADPCM.step);
-            pcm[outcount++]=decode_ADPCM_3_sample((adpcm[i] >> 2) & 0x7,&SBEMU_ADPCM.ref,&SBEMU_ADPCM.step);
-            pcm[outcount++]=decode_ADPCM_3_sample((adpcm[i] & 0x3) << 1,&SBEMU_ADPCM.ref,&SBEMU_ADPCM.step);
-        }
-        else if(SBEMU_Bits == 4)
-        {
-            pcm[outcount++]=decode_ADPCM_4_sample(adpcm[i] >> 4,&SBEMU_ADPCM.ref,&SBEMU_ADPCM.step);
-            pcm[outcount++]=decode_ADPCM_4_sample(adpcm[i]& 0xf,&SBEMU_ADPCM.ref,&SBEMU_ADPCM.step);
-        }
-    }
-    //assert(outcount <= outbytes);
-    _LOG("SBEMU: adpcm decode: %d %d", outcount, outbytes);
-    memcpy(adpcm, pcm, outcount);
-    free(pcm);
-    return outcount;
+void SBEMU_GetADPCMState(uint8_t* ref, int* step)
+{
+    *ref = SBEMU_ADPCM.ref;
+    *step = SBEMU_ADPCM.step;
 }
 
 int SBEMU_GetDirectCount()
@@ -105,8 +105,25 @@ typedef struct //external functions
     void (*RaiseIRQ)(uint8_t);      //raise virtual IRQ - not used (not working)
     void(*DMA_Write)(int,uint8_t);  //write DMA, (channel, value)
     uint32_t (*DMA_Size)(int);      //Get DMA size (channel)
+    void (*MixerChanged)(void);     //volume registers changed (or mixer reset)
 }SBEMU_EXTFUNS;
 
+//write buffer status (2xCh) policies
+#define SBEMU_WS_TOGGLE 0 //bit7 toggles on each read: busy/ready alternately
+#define SBEMU_WS_TIMED  1 //busy for a while after each write to 2xCh, like real DSP. needs RDTSC (586+)
+#define SBEMU_WS_READY  2 //always ready. for drivers not waiting on busy first
+
+typedef struct //DSP status port values. may be relocated into memory shared with trap stubs (see SBEMU_SetDSPStatus)
+{
+    uint8_t WS;         //write buffer status (2xCh), bit7 depends on WSPolicy
+    uint8_t RS;         //read buffer status (2xEh), bit7 toggles on each read
+    uint8_t IntPending; //8bit interrupt pending: reading 2xEh acknowledges it, not a pure status read
+    uint8_t WSPolicy;   //SBEMU_WS_*
+    uint64_t WSReady;   //SBEMU_WS_TIMED: TSC when busy bit of WS expires
+}SBEMU_DSPSTATUS;
+
+typedef int (*SBEMU_CONVERT_FUNC)(int16_t* pcm, const uint8_t* src, int bytes); //convert DMA bytes to 16bit stereo, return frames
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -140,12 +157,20 @@ int SBEMU_GetSampleBytes();
 int SBEMU_GetAuto();
 int SBEMU_GetPos(); //get pos in bytes
 int SBEMU_SetPos(int pos); //set pos in bytes
-int SBEMU_IRQTriggered();
-void SBEMU_SetIRQTriggered(int triggered);
+//delay of IRQs requested by DSP commands (F2h/F3h) in TSC cycles. 0: raise on next service (i.e. no TSC)
+void SBEMU_SetIRQDelay(uint32_t cycles);
+//raise queued IRQs due at TSC 'now' (0 with no delay set), return count. caller invokes the virtual IRQ if not 0
+int SBEMU_ServiceEvents(uint64_t now);
 uint8_t SBEMU_GetMixerReg(uint8_t index);
 
-//for 4/3/2bit
-int SBEMU_DecodeADPCM(uint8_t* adpcm, int bytes); //decode in place
+//move DSP status to caller's memory (i.e. read by real mode trap stub), current values copied. NULL to restore internal
+void SBEMU_SetDSPStatus(SBEMU_DSPSTATUS* status);
+//select write buffer status policy. busycycles: TSC cycles the DSP stays busy after a write, for SBEMU_WS_TIMED
+void SBEMU_SetWSPolicy(int policy, uint32_t busycycles);
+
+//for DMA transfer: 8/16bit PCM and 4/3/2bit ADPCM
+SBEMU_CONVERT_FUNC SBEMU_GetConverter(); //converter of current format, updated on DSP command/mode change
+void SBEMU_GetADPCMState(uint8_t* ref, int* step); //ADPCM decoder state after the last converted byte. step: scale of ctadpcm.h
 
 //for SBEMU_CMD_8BIT_DIRECT
 int SBEMU_GetDirectCount();
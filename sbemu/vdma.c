@@ -18,7 +18,7 @@ static uint32_t VDMA_InIO[8]; //in the middle of reading counter/addr
 static uint8_t VDMA_DelayUpdate[8];
 
 static uint8_t VDMA_Complete[8];
-static const uint8_t VDMA_PortChannelMap[16] = //0x8x map
+static const int8_t VDMA_PortChannelMap[16] = //0x8x map. -1: not a page register
 {
     -1, 2, 3, 1, -1, -1, -1, 0,
     -1, 6, 7, 5, -1, -1, -1, 4,
@@ -26,6 +26,22 @@ static const uint8_t VDMA_PortChannelMap[16] = //0x8x map
 
 #define VMDA_IS_CHANNEL_VIRTUALIZED(channel) (channel != -1 && VDMA_VMask[channel])
 
+//mapped windows of guest DMA memory above 1M
+#define VDMA_MAPCACHE_SIZE 4
+#define VDMA_MAPCACHE_WINDOW (64*1024*2) //minimal window size, covers a whole 64K DMA buffer at any page offset
+
+typedef struct
+{
+    uint32_t physical; //page aligned
+    uint32_t size;
+    uint32_t linear; //0: unused
+    uint32_t lastuse;
+    uint32_t refcount;
+}VDMA_MapEntry;
+
+static VDMA_MapEntry VDMA_MapCache[VDMA_MAPCACHE_SIZE];
+static uint32_t VDMA_MapClock;
+
 void VDMA_Write(uint16_t port, uint8_t byte)
 {
     _LOG("VDMA write: %x, %x\n", port, byte);
@@ -50,7 +66,7 @@ void VDMA_Write(uint16_t port, uint8_t byte)
         else
             VDMA_Regs[base+port] = byte;
     }
-    else if((port >= VDMA_REG_CH0_ADDR && port <= VDMA_REG_CH3_COUNTER) || (port >= VDMA_REG_CH4_ADDR && port <= VDMA_REG_CH7_COUNTER))
+    else if(port <= VDMA_REG_CH3_COUNTER || (port >= VDMA_REG_CH4_ADDR && port <= VDMA_REG_CH7_COUNTER))
     {
         int channel = (port>>1);
         int base = 0;
@@ -108,7 +124,7 @@ uint8_t VDMA_Read(uint16_t port)
 
     if(VMDA_IS_CHANNEL_VIRTUALIZED(channel))
     {
-        if((port >= VDMA_REG_CH0_ADDR && port <= VDMA_REG_CH3_COUNTER) || (port >= VDMA_REG_CH4_ADDR && port <= VDMA_REG_CH7_COUNTER) )
+        if(port <= VDMA_REG_CH3_COUNTER || (port >= VDMA_REG_CH4_ADDR && port <= VDMA_REG_CH7_COUNTER) )
         {
             int base = 0;
             if((port >= VDMA_REG_CH4_ADDR && port <= VDMA_REG_CH7_COUNTER))
@@ -130,7 +146,6 @@ uint8_t VDMA_Read(uint16_t port)
                 uint8_t ret = ((value>>8)&0xFF);
                 if(VDMA_DelayUpdate[channel])
                 {
-                    int size = channel <= 3 ? 1 : 2;
                     int base2 = channel <= 3 ? (channel<<1) : 16+((channel-4)<<1);
                     VDMA_Regs[base2+1] = VDMA_CurCounter[channel]-1; //update counter reg
                     VDMA_Regs[base2] = VDMA_Addr[channel] + VDMA_Index[channel]; //update addr reg
@@ -242,15 +257,72 @@ void VDMA_WriteData(int channel, uint8_t data)
     {
         uint32_t addr = VDMA_GetAddress(channel);
         int32_t index = VDMA_GetIndex(channel);
-        
-        if(addr>1024*1024)
-            addr = DPMI_MapMemory(addr, 65536);
+        uint32_t linear = VDMA_AcquireLinear(addr+index, 1);
 
-        _LOG("dmaw: %x, %d\n", addr+index, data);
-        DPMI_CopyLinear(addr+index, DPMI_PTR2L(&data), 1);
-
-        if(addr>1024*1024)
-            DPMI_UnmappMemory(addr);
+        _LOG("dmaw: %x, %d\n", linear, data);
+        if(linear)
+        {
+            DPMI_CopyLinear(linear, DPMI_PTR2L(&data), 1);
+            VDMA_ReleaseLinear(linear);
+        }
         VDMA_SetIndexCounter(channel, index+1, VDMA_GetCounter(channel)-1);
     }
 }
+
+//shared by trap handler (VDMA_WriteData, interrupts enabled) and card ISR: lookup, eviction & release done with interrupts off
+uint32_t VDMA_AcquireLinear(uint32_t addr, uint32_t size)
+{
+    if(addr+size <= 1024*1024) //1:1 mapped
+        return addr;
+
+    uint32_t linear = 0;
+    CLIS();
+    VDMA_MapEntry* victim = NULL;
+    for(int i = 0; i < VDMA_MAPCACHE_SIZE; ++i)
+    {
+        VDMA_MapEntry* e = &VDMA_MapCache[i];
+        if(e->linear != 0 && addr >= e->physical && addr+size <= e->physical+e->size)
+        {
+            ++e->refcount;
+            e->lastuse = ++VDMA_MapClock;
+            linear = e->linear + (addr - e->physical);
+            break;
+        }
+        if(e->refcount == 0 && (victim == NULL || (victim->linear != 0 && (e->linear == 0 || e->lastuse < victim->lastuse))))
+            victim = e;
+    }
+    if(linear == 0 && victim != NULL) //not cached and not all in use
+    {
+        if(victim->linear != 0)
+            DPMI_UnmappMemory(victim->linear);
+        victim->linear = 0;
+        victim->physical = addr&~0xFFF;
+        victim->size = align(max(addr-victim->physical+size, VDMA_MAPCACHE_WINDOW), 4096);
+        victim->linear = DPMI_MapMemory(victim->physical, victim->size);
+        _LOG("VDMA map: %x, %x => %x\n", victim->physical, victim->size, victim->linear);
+        if(victim->linear != 0)
+        {
+            victim->refcount = 1;
+            victim->lastuse = ++VDMA_MapClock;
+            linear = victim->linear + (addr - victim->physical);
+        }
+    }
+    STIL();
+    return linear;
+}
+
+void VDMA_ReleaseLinear(uint32_t linear)
+{
+    CLIS();
+    for(int i = 0; i < VDMA_MAPCACHE_SIZE; ++i)
+    {
+        VDMA_MapEntry* e = &VDMA_MapCache[i];
+        if(e->linear != 0 && linear >= e->linear && linear < e->linear+e->size)
+        {
+            if(e->refcount > 0)
+                --e->refcount;
+            break;
+        }
+    }
+    STIL();
+}
@@ -57,6 +57,11 @@ void VDMA_ToggleComplete(int channel);
 
 void VDMA_WriteData(int channel, uint8_t data);
 
+//linear addr of guest physical DMA memory, through a small LRU cache of DPMI mappings (below 1M is 1:1 and not cached).
+//return 0 on failure. every successful acquire must be paired with a release, in use mappings are never evicted.
+uint32_t VDMA_AcquireLinear(uint32_t addr, uint32_t size);
+void VDMA_ReleaseLinear(uint32_t linear);
+
 #ifdef __cplusplus
 }
 #endif
@@ -7,53 +7,99 @@
 #include <string.h>
 
 static int VIRQ_Irq = -1;
-static uint8_t VIRQ_ISR[2];
-static uint8_t VIRQ_OCW[2];
+//guest view of the PICs while a virtual IRQ is in service. PIC ports stay trapped, so every guest access comes here
+static uint8_t VIRQ_ISR[2];     //virtual in-service bits
+static uint8_t VIRQ_ReadISR[2]; //guest's OCW3 read select: 1: ISR, 0: IRR
+static uint8_t VIRQ_IMR[2];     //mask seen/written by guest during virtual IRQ, applied to real PIC after it
+static uint8_t VIRQ_IMRWritten;  //bit0: master, bit1: slave
+static uint8_t VIRQ_ICWLeft[2];  //ICW2-4 bytes still expected on data port after ICW1
+static uint8_t VIRQ_Poll[2];     //OCW3 poll issued during virtual IRQ: next command port read returns poll result
 
 #define VIRQ_IS_VIRTUALIZING() (VIRQ_Irq != -1)
+#define VIRQ_PIC_INDEX(port) (((port)&0xF0) == 0x20 ? 0 : 1)
+
+#define VIRQ_OCW2_EOI 0x20
+#define VIRQ_OCW2_SEOI 0x60 //specific EOI, low 3 bits: level
+#define VIRQ_OCW3 0x08
+#define VIRQ_OCW3_READ 0x02 //read select valid
+#define VIRQ_OCW3_ISR 0x01
+#define VIRQ_OCW3_POLL 0x04
+#define VIRQ_ICW1 0x10
+#define VIRQ_ICW1_IC4 0x01 //ICW4 follows
+#define VIRQ_ICW1_SNGL 0x02 //single PIC, no ICW3
 
 void VIRQ_Write(uint16_t port, uint8_t value)
 {
     //_LOG("VIRQW:%x,%x\n",port,value);
-    if(VIRQ_IS_VIRTUALIZING())
+    int index = VIRQ_PIC_INDEX(port);
+    BOOL command = (port&0x0F) == 0x00;
+    if(command && (value&VIRQ_ICW1)) //ICW1: guest re-inits the PIC, always goes to real PIC
+    {
+        VIRQ_ICWLeft[index] = (uint8_t)(1 + ((value&VIRQ_ICW1_SNGL) ? 0 : 1) + ((value&VIRQ_ICW1_IC4) ? 1 : 0));
+        VIRQ_ReadISR[index] = 0; //init selects IRR
+        VIRQ_Poll[index] = 0;
+        if(VIRQ_IS_VIRTUALIZING()) //init clears ISR & IMR
+        {
+            VIRQ_ISR[index] = 0;
+            VIRQ_IMR[index] = 0;
+            VIRQ_IMRWritten |= (uint8_t)(1<<index);
+        }
+    }
+    else if(!command && VIRQ_ICWLeft[index]) //ICW2-4, not IMR
+    {
+        --VIRQ_ICWLeft[index];
+        UntrappedIO_OUT(port, value);
+        PIC_InvalidateIRQMask();
+        if(VIRQ_ICWLeft[index] == 0 && VIRQ_IS_VIRTUALIZING())
+            UntrappedIO_OUT(port, 0xFF); //init unmasked real PIC: keep it masked until virtual IRQ returns
+        return;
+    }
+    else if(command && (value&0x18) == VIRQ_OCW3) //OCW3: track read select, pass through to keep real PIC same as guest view after virtual IRQ
+    {
+        if(value&VIRQ_OCW3_READ)
+            VIRQ_ReadISR[index] = value&VIRQ_OCW3_ISR;
+        if((value&VIRQ_OCW3_POLL) && VIRQ_IS_VIRTUALIZING()) //a real poll would acknowledge a masked real IRQ
+        {
+            VIRQ_Poll[index] = 1;
+            return;
+        }
+    }
+    else if(VIRQ_IS_VIRTUALIZING())
     {
         _LOG("VIRQW:%x,%x\n",port,value);
-        if((port&0x0F) == 0x00)
+        if(command)
         {
-            int index = ((port==0x20) ? 0 : 1);
-            VIRQ_OCW[index] = value;
-
-            if(value == 0x20) //EOI: clear ISR
-            {
+            if(value == VIRQ_OCW2_EOI) //EOI: clear ISR. don't send to real PIC, it's virtualized
                 VIRQ_ISR[index] = 0;
-                return; //don't send to real PIC. it's virtualized
-            }
-
-            if(value == 0x0B) //read ISR
-                return; //don't send to real PIC, will be handled in VIRQ_Read.
+            else if((value&0xF8) == VIRQ_OCW2_SEOI)
+                VIRQ_ISR[index] &= (uint8_t)~(1<<(value&0x07));
+            return;
         }
+        VIRQ_IMR[index] = value; //real PIC masked during virtual IRQ, apply on return
+        VIRQ_IMRWritten |= (uint8_t)(1<<index);
         return;
     }
     UntrappedIO_OUT(port, value);
+    if(!command || (value&VIRQ_ICW1)) //IMR or ICW1 (init clears IMR)
+        PIC_InvalidateIRQMask();
 }
 
 uint8_t VIRQ_Read(uint16_t port)
 {
+    int index = VIRQ_PIC_INDEX(port);
+    if((port&0x0F) == 0x00 && VIRQ_Poll[index]) //poll result: no request pending while real PIC masked
+    {
+        VIRQ_Poll[index] = 0;
+        return 0;
+    }
     if(VIRQ_IS_VIRTUALIZING())
     {
-        //_LOG("VIRQR:%x\n",port);
         if((port&0x0F) == 0x00)
         {
-            int index = ((port==0x20) ? 0 : 1);
-            if(VIRQ_OCW[index] == 0x0B)//ISR
-            {
-                _LOG("VIRQR: %x %x\n",port, VIRQ_ISR[index]);
-                return VIRQ_ISR[index];
-            }
-            //return VIRQ_OCW[index] == 0x0B ? VIRQ_ISR[index] : UntrappedIO_IN(port);
+            _LOG("VIRQR: %x %x\n",port, VIRQ_ISR[index]);
+            return VIRQ_ReadISR[index] ? VIRQ_ISR[index] : 0; //nothing else pending while real PIC masked
         }
-        _LOG("VIRQR: %x 0\n", port);
-        return 0;
+        return VIRQ_IMR[index];
     }
     return UntrappedIO_IN(port);
 }
@@ -63,7 +109,7 @@ void VIRQ_Invoke(uint8_t irq, DPMI_REG* reg, BOOL VM)
     _LOG("CALLINT %d\n", irq);
     //CLIS();
     int mask = PIC_GetIRQMask();
-    PIC_SetIRQMask(0xFFFF);
+    PIC_SetIRQMask(0xFFFF); //no real IRQ nested: guest's EOIs all belong to the virtual one
     VIRQ_ISR[0] = VIRQ_ISR[1] = 0;
     if(irq < 8) //master
         VIRQ_ISR[0] = 1 << irq;
@@ -72,6 +118,9 @@ void VIRQ_Invoke(uint8_t irq, DPMI_REG* reg, BOOL VM)
         VIRQ_ISR[0] = 0x04; //cascade
         VIRQ_ISR[1] = 1 << (irq-8);
     }
+    VIRQ_IMR[0] = (uint8_t)mask;
+    VIRQ_IMR[1] = (uint8_t)(mask>>8);
+    VIRQ_IMRWritten = 0;
     
     VIRQ_Irq = irq;
     if(VM) //pm/rm int method not working good yet (Miles Sound) - works after modify HDPMI.
@@ -99,6 +148,8 @@ void VIRQ_Invoke(uint8_t irq, DPMI_REG* reg, BOOL VM)
     VIRQ_Irq = -1;
 
     //_LOG("CPU FLAGS: %x\n", CPU_FLAGS());
+    if(VIRQ_IMRWritten) //keep guest's mask changes made in its handler
+        mask = (VIRQ_IMRWritten&1 ? VIRQ_IMR[0] : (mask&0xFF)) | (VIRQ_IMRWritten&2 ? VIRQ_IMR[1]<<8 : (mask&0xFF00));
     PIC_SetIRQMask(mask);
     //STIL();
     _LOG("CALLINTEND\n");
@@ -86,7 +86,14 @@ void TestSound(BOOL play)
     if(aui.freq_card != header.sample_rate) //soundcard not supported
     {
         printf("frequency: %d => %d\n", header.sample_rate, aui.freq_card);
-        samplecount = mixer_speed_lq(samples, samplecount, header.channels, header.sample_rate, aui.freq_card);
+        mixer_speed_stream_s resampler;
+        mixer_speed_stream_init(&resampler, header.channels, header.sample_rate, aui.freq_card);
+        unsigned int frames = samplecount / header.channels;
+        unsigned int outframes = (unsigned int)(((unsigned long long)frames*aui.freq_card+header.sample_rate-1)/header.sample_rate) + 1;
+        short* resampled = (short*)malloc(outframes*header.channels*sizeof(short));
+        samplecount = mixer_speed_stream(&resampler, resampled, outframes, samples, &frames) * header.channels;
+        free(samples);
+        samples = resampled;
     }
     TEST_Sample = samples;
     TEST_SampleLen = samplecount;
@@ -0,0 +1,548 @@
+//host benchmark of the card interrupt audio pipeline (pipeline.c, run by MAIN_Interrupt in main.c):
+//guest DMA fetch & format conversion, resampling, OPL synthesis and final mix, each timed separately.
+//sweeps every DSP output format, guest rate and OPL load through synthetic guest DMA buffers,
+//reports cycles/frame and frames/second per stage, and checks the mixed output against golden hashes (golden.h).
+//also checks the table ADPCM decoder of sbemu.c against the per sample decoders of ctadpcm.h, bit exact.
+//build: see Makefile.host
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <platform.h>
+#include <sbemucfg.h>
+#include <dpmi/dpmi.h>
+#include <sbemu.h>
+#include <vdma.h>
+#include <opl3emu.h>
+#include <mpxplay.h>
+#include <au_mixer/mix_func.h>
+#include "pipeline.h"
+#include "hostshim.h"
+#include "ctadpcm.h" //reference ADPCM decoders
+
+#define BENCH_CARD_RATE 44100
+#define BENCH_INT_FRAMES 512    //card frames per interrupt
+#define BENCH_INTS 256          //interrupts per case. golden hashes are recorded with this count
+#define BENCH_DMA_SIZE 16384    //guest auto-init DMA buffer
+#define BENCH_SB_BLOCK 4096     //DSP block: guest IRQ every 4K
+#define BENCH_DMA_LOW 0x30000   //guest DMA buffer in conventional memory: converted in place
+#define BENCH_DMA_HIGH 0x400000 //above 1M: through VDMA map cache and a bounce copy
+#define BENCH_DMABUF_ADDR 0x800000 //bounce buffer, in guest memory for DPMI_CopyLinear
+
+#define BENCH_IRQ 5
+#define BENCH_DMA 1
+#define BENCH_HDMA 5
+#define BENCH_DSPVER 0x0400 //SB16, all formats available
+
+#define BENCH_DMA16_REG(reg) (VDMA_REG_STATUS_CMD16 + ((reg)-VDMA_REG_STATUS_CMD)*2) //control registers of the 16bit controller
+
+typedef struct
+{
+    const char* name;
+    uint8_t cmd;    //DSP output command
+    uint8_t mode;   //SB16 mode byte, following 0xBx/0xCx
+    uint8_t bits;
+    uint8_t channels;
+}BENCH_FORMAT;
+
+static const BENCH_FORMAT BENCH_Formats[] =
+{
+    {"pcm8m", SBEMU_CMD_8OR16_8_OUT_AUTO, SBEMU_CMD_MODE_PCM8_MONO, 8, 1},
+    {"pcm8s", SBEMU_CMD_8OR16_8_OUT_AUTO, SBEMU_CMD_MODE_PCM8_STEREO, 8, 2},
+    {"pcm16m", SBEMU_CMD_8OR16_16_OUT_AUTO, SBEMU_CMD_MODE_PCM16_MONO, 16, 1},
+    {"pcm16s", SBEMU_CMD_8OR16_16_OUT_AUTO, SBEMU_CMD_MODE_PCM16_STEREO, 16, 2},
+    {"adpcm4", SBEMU_CMD_4BIT_OUT_AUTO, 0, 4, 1},
+    {"adpcm3", SBEMU_CMD_3BIT_OUT_AUTO, 0, 3, 1},
+    {"adpcm2", SBEMU_CMD_2BIT_OUT_AUTO, 0, 2, 1},
+};
+#define BENCH_FORMAT_COUNT countof(BENCH_Formats)
+
+//generic up, x4, x2, none, generic down
+static const int BENCH_Rates[] = {8000, 11025, 22050, 44100, 48000};
+#define BENCH_RATE_COUNT countof(BENCH_Rates)
+
+enum
+{
+    BENCH_OPL_OFF,  //emulation disabled
+    BENCH_OPL_IDLE, //enabled, no voice playing
+    BENCH_OPL_OPL2, //9 melodic voices
+    BENCH_OPL_OPL3, //OPL3 mode, 18 stereo voices
+    BENCH_OPL_COUNT,
+};
+static const char* BENCH_OPLNames[BENCH_OPL_COUNT] = {"off", "idle", "opl2", "opl3"};
+
+#define BENCH_CASES (BENCH_FORMAT_COUNT*BENCH_RATE_COUNT*BENCH_OPL_COUNT)
+
+#define BENCH_ADPCM_BYTES 4096  //random stream per ADPCM check
+#define BENCH_ADPCM_SEEDS 16    //streams per bit depth and reference mode
+#define BENCH_ADPCM_MAXCHUNK 67 //converter calls take 1~MAXCHUNK bytes
+
+#include "golden.h"
+
+static const char* BENCH_StageNames[PIPELINE_STAGES] = {"convert", "resample", "opl", "mix"};
+static uint64_t BENCH_Cycles[PIPELINE_STAGES];
+
+//pipeline buffers, sized as MAIN_ArenaInit does for BENCH_INT_FRAMES
+#define BENCH_PCM_FRAMES (BENCH_INT_FRAMES+128)
+#define BENCH_SBPCM_FRAMES (BENCH_PCM_FRAMES*2)
+static int16_t BENCH_SBPCM[BENCH_SBPCM_FRAMES*2];
+static int16_t BENCH_PCM[BENCH_PCM_FRAMES*2];
+static int16_t BENCH_OPLPCM[BENCH_PCM_FRAMES*2];
+static int16_t BENCH_Out[BENCH_INT_FRAMES*2]; //card buffer
+
+static PIPELINE BENCH_Pipe;
+
+//SB16 mixer defaults: unit voice & FM volume (see MAIN_UpdateGains)
+#define BENCH_GAIN (1<<CV_MIX_GAIN_SHIFT)
+static const int16_t BENCH_GainMix[4] = {BENCH_GAIN, BENCH_GAIN*2, BENCH_GAIN, BENCH_GAIN*2};
+static const int16_t BENCH_GainVoice[4] = {BENCH_GAIN, 0, BENCH_GAIN, 0};
+static const int16_t BENCH_GainMidi[4] = {BENCH_GAIN, 0, BENCH_GAIN, 0};
+static const int16_t BENCH_GainMaster[2] = {BENCH_GAIN, BENCH_GAIN}; //non-linear mix (default)
+
+static SBEMU_EXTFUNS BENCH_SbemuExtFun;
+static uint32_t BENCH_DMAAddr = BENCH_DMA_LOW;
+static int BENCH_Quality;
+static int BENCH_IRQs;
+static uint32_t BENCH_Hash;
+
+static void BENCH_HashData(const void* data, int bytes)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    for(int i = 0; i < bytes; ++i) //FNV-1a
+        BENCH_Hash = (BENCH_Hash ^ p[i]) * 16777619u;
+}
+
+static uint32_t BENCH_Random(uint32_t* seed)
+{
+    *seed = *seed * 1664525u + 1013904223u;
+    return *seed >> 8;
+}
+
+//triangle waves of different periods on each channel, with a bit of noise
+static void BENCH_FillGuestBuffer(const BENCH_FORMAT* fmt)
+{
+    uint8_t* buf = (uint8_t*)DPMI_L2PTR(BENCH_DMAAddr);
+    uint32_t seed = 1;
+    if(fmt->bits < 8) //any byte stream is valid ADPCM
+    {
+        for(int i = 0; i < BENCH_DMA_SIZE; ++i)
+            buf[i] = (uint8_t)BENCH_Random(&seed);
+        return;
+    }
+    int samples = BENCH_DMA_SIZE / (fmt->bits/8);
+    for(int i = 0; i < samples; ++i)
+    {
+        int frame = i / fmt->channels;
+        int period = (i % fmt->channels) ? 61 : 97;
+        int phase = frame % period;
+        int tri = (phase < period/2 ? phase*2 : (period-phase)*2) * 65535 / period - 32768;
+        int16_t s = (int16_t)max(-32768, min(32767, tri/2 + (int)(BENCH_Random(&seed)&0x3FF) - 0x200));
+        if(fmt->bits == 8)
+            buf[i] = (uint8_t)((s>>8) + 128);
+        else
+            ((int16_t*)buf)[i] = s;
+    }
+}
+
+//program the virtual DMA controller for an auto-init playback transfer of the whole guest buffer
+static void BENCH_SetupDMA(int channel)
+{
+    uint32_t addr = BENCH_DMAAddr;
+    uint32_t count = BENCH_DMA_SIZE;
+    VDMA_Virtualize(channel, TRUE);
+    if(channel <= 3)
+    {
+        static const uint8_t pages[4] = {VDMA_REG_CH0_PAGEADDR, VDMA_REG_CH1_PAGEADDR, VDMA_REG_CH2_PAGEADDR, VDMA_REG_CH3_PAGEADDR};
+        VDMA_Write(VDMA_REG_SINGLEMASK, 0x04 | channel);
+        VDMA_Write(VDMA_REG_FLIPFLOP, 0);
+        VDMA_Write(VDMA_REG_MODE, 0x58 | channel); //single, auto-init, read (memory to device)
+        VDMA_Write(VDMA_REG_CH0_ADDR + channel*2, addr&0xFF);
+        VDMA_Write(VDMA_REG_CH0_ADDR + channel*2, (addr>>8)&0xFF);
+        VDMA_Write(pages[channel], (addr>>16)&0xFF);
+        VDMA_Write(VDMA_REG_CH0_COUNTER + channel*2, (count-1)&0xFF);
+        VDMA_Write(VDMA_REG_CH0_COUNTER + channel*2, ((count-1)>>8)&0xFF);
+        VDMA_Write(VDMA_REG_SINGLEMASK, channel);
+    }
+    else
+    {
+        static const uint8_t pages[4] = {VDMA_REG_CH4_PAGEADDR, 0x8B, 0x89, VDMA_REG_CH7_PAGEADDR};
+        int ch = channel - 4;
+        int port = VDMA_REG_CH4_ADDR + ch*4;
+        VDMA_Write(BENCH_DMA16_REG(VDMA_REG_SINGLEMASK), 0x04 | ch);
+        VDMA_Write(BENCH_DMA16_REG(VDMA_REG_FLIPFLOP), 0);
+        VDMA_Write(BENCH_DMA16_REG(VDMA_REG_MODE), 0x58 | ch);
+        uint32_t word = (addr&0xFFFF)>>1; //word address in the page, as VDMA_GetAddress expects
+        VDMA_Write(port, word&0xFF);
+        VDMA_Write(port, (word>>8)&0xFF);
+        VDMA_Write(pages[ch], (addr>>16)&0xFF);
+        VDMA_Write(port+2, (count/2-1)&0xFF); //words
+        VDMA_Write(port+2, ((count/2-1)>>8)&0xFF);
+        VDMA_Write(BENCH_DMA16_REG(VDMA_REG_SINGLEMASK), ch);
+    }
+}
+
+static void BENCH_DSP(uint8_t value)
+{
+    SBEMU_DSP_Write(0x220 + SBEMU_PORT_DSP_WRITE_WS, value);
+}
+
+//reset the DSP and start an auto-init transfer of the guest buffer, in SB_BLOCK sized blocks
+static void BENCH_StartDSP(const BENCH_FORMAT* fmt, int rate)
+{
+    SBEMU_DSP_Reset(0x220 + SBEMU_PORT_DSP_RESET, 1);
+    SBEMU_DSP_Reset(0x220 + SBEMU_PORT_DSP_RESET, 0);
+    BENCH_SetupDMA(fmt->bits == 16 ? SBEMU_GetHDMA() : SBEMU_GetDMA());
+    BENCH_FillGuestBuffer(fmt);
+
+    BENCH_DSP(SBEMU_CMD_DAC_SPEAKER_ON);
+    BENCH_DSP(SBEMU_CMD_SET_SAMPLERATE);
+    BENCH_DSP((rate>>8)&0xFF);
+    BENCH_DSP(rate&0xFF);
+    if(fmt->bits < 8)
+    {
+        int len = BENCH_SB_BLOCK - 1; //bytes
+        BENCH_DSP(SBEMU_CMD_SET_SIZE);
+        BENCH_DSP(len&0xFF);
+        BENCH_DSP((len>>8)&0xFF);
+        BENCH_DSP(fmt->cmd);
+    }
+    else
+    {
+        int len = BENCH_SB_BLOCK / (fmt->bits/8) - 1; //samples
+        BENCH_DSP(fmt->cmd);
+        BENCH_DSP(fmt->mode);
+        BENCH_DSP(len&0xFF);
+        BENCH_DSP((len>>8)&0xFF);
+    }
+}
+
+static void BENCH_OPLWrite(int reg, uint8_t value)
+{
+    if(reg & 0x100)
+    {
+        OPL3EMU_SecondaryWriteIndex(reg&0xFF);
+        OPL3EMU_SecondaryWriteData(value);
+    }
+    else
+    {
+        OPL3EMU_PrimaryWriteIndex(reg);
+        OPL3EMU_PrimaryWriteData(value);
+    }
+}
+
+//sustained 2-op FM voices on all melodic channels
+static void BENCH_StartOPL(int load)
+{
+    static const uint8_t operators[9] = {0x00, 0x01, 0x02, 0x08, 0x09, 0x0A, 0x10, 0x11, 0x12};
+    OPL3EMU_Init(BENCH_CARD_RATE);
+    if(load == BENCH_OPL_IDLE)
+        return;
+    BENCH_OPLWrite(0x01, 0x20); //waveform select
+    if(load == BENCH_OPL_OPL3)
+        BENCH_OPLWrite(0x105, 0x01);
+    int voices = load == BENCH_OPL_OPL3 ? 18 : 9;
+    for(int v = 0; v < voices; ++v)
+    {
+        int bank = (v / 9) << 8;
+        int ch = v % 9;
+        int op = bank | operators[ch];
+        int fnum = 0x160 + v*0x1B;
+        BENCH_OPLWrite(0x20+op, 0x21);     //sustain, mult 1
+        BENCH_OPLWrite(0x23+op, 0x21);
+        BENCH_OPLWrite(0x40+op, 0x10);     //modulator level
+        BENCH_OPLWrite(0x43+op, 0x00);
+        BENCH_OPLWrite(0x60+op, 0xF4);     //attack, decay
+        BENCH_OPLWrite(0x63+op, 0xF4);
+        BENCH_OPLWrite(0x80+op, 0x07);     //sustain level, release
+        BENCH_OPLWrite(0x83+op, 0x07);
+        BENCH_OPLWrite(0xE0+op, v&0x3);    //waveform
+        BENCH_OPLWrite(0xE3+op, 0x00);
+        BENCH_OPLWrite(0xC0+bank+ch, 0x0C | (load == BENCH_OPL_OPL3 ? ((v&1) ? 0x20 : 0x10) : 0)); //feedback, FM. OPL3: alternate left/right
+        BENCH_OPLWrite(0xA0+bank+ch, fnum&0xFF);
+        BENCH_OPLWrite(0xB0+bank+ch, 0x20 | (4<<2) | ((fnum>>8)&0x3)); //key on, block 4
+    }
+}
+
+//decode one stream with the per sample decoders of ctadpcm.h, as DOSBox does. return samples
+static int BENCH_ADPCMReference(uint8_t* out, const uint8_t* src, int bytes, int bits, BOOL useref, uint8_t* ref, Bits* scale)
+{
+    int i = 0, n = 0;
+    if(useref)
+    {
+        *ref = src[i++];
+        *scale = 0;
+    }
+    for(; i < bytes; ++i)
+    {
+        uint8_t b = src[i];
+        if(bits == 2)
+        {
+            out[n++] = decode_ADPCM_2_sample((b >> 6) & 0x3, ref, scale);
+            out[n++] = decode_ADPCM_2_sample((b >> 4) & 0x3, ref, scale);
+            out[n++] = decode_ADPCM_2_sample((b >> 2) & 0x3, ref, scale);
+            out[n++] = decode_ADPCM_2_sample(b & 0x3, ref, scale);
+        }
+        else if(bits == 3)
+        {
+            out[n++] = decode_ADPCM_3_sample((b >> 5) & 0x7, ref, scale);
+            out[n++] = decode_ADPCM_3_sample((b >> 2) & 0x7, ref, scale);
+            out[n++] = decode_ADPCM_3_sample((b & 0x3) << 1, ref, scale);
+        }
+        else
+        {
+            out[n++] = decode_ADPCM_4_sample(b >> 4, ref, scale);
+            out[n++] = decode_ADPCM_4_sample(b & 0xF, ref, scale);
+        }
+    }
+    return n;
+}
+
+//table decoder of sbemu.c against the reference decoders: random streams in random chunks, with and without reference byte.
+//the no-reference transfer continues from the reference of the previous one. return failed streams
+static int BENCH_CheckADPCM(int* checked)
+{
+    static const uint8_t cmds[3][2] = //[bits-2][reference byte]
+    {
+        {SBEMU_CMD_2BIT_OUT_1_NREF, SBEMU_CMD_2BIT_OUT_1},
+        {SBEMU_CMD_3BIT_OUT_1_NREF, SBEMU_CMD_3BIT_OUT_1},
+        {SBEMU_CMD_4BIT_OUT_1_NREF, SBEMU_CMD_4BIT_OUT_1},
+    };
+    static uint8_t src[BENCH_ADPCM_BYTES];
+    static uint8_t expected[BENCH_ADPCM_BYTES*4];
+    static int16_t pcm[BENCH_ADPCM_BYTES*4*2];
+    int failed = 0;
+    uint32_t seed = 7;
+    for(int bits = 2; bits <= 4; ++bits)
+    for(int i = 0; i < BENCH_ADPCM_SEEDS*2; ++i)
+    {
+        BOOL useref = !(i&1);
+        for(int j = 0; j < BENCH_ADPCM_BYTES; ++j)
+            src[j] = (uint8_t)BENCH_Random(&seed);
+        uint8_t ref;
+        Bits scale;
+        SBEMU_GetADPCMState(&ref, &scale); //reference kept from previous transfer
+        scale = 0; //reset by each command
+        int samples = BENCH_ADPCMReference(expected, src, BENCH_ADPCM_BYTES, bits, useref, &ref, &scale);
+
+        int len = BENCH_ADPCM_BYTES - 1;
+        BENCH_DSP(cmds[bits-2][useref]);
+        BENCH_DSP(len&0xFF);
+        BENCH_DSP((len>>8)&0xFF);
+        int count = 0;
+        for(int pos = 0; pos < BENCH_ADPCM_BYTES;)
+        {
+            int bytes = 1 + (int)(BENCH_Random(&seed) % BENCH_ADPCM_MAXCHUNK);
+            bytes = min(bytes, BENCH_ADPCM_BYTES-pos);
+            count += SBEMU_GetConverter()(pcm+count*2, src+pos, bytes);
+            pos += bytes;
+        }
+        SBEMU_Stop();
+        uint8_t tref;
+        int tstep;
+        SBEMU_GetADPCMState(&tref, &tstep);
+
+        BOOL ok = count == samples && tref == ref && tstep == scale;
+        for(int j = 0; j < samples && ok; ++j)
+            ok = pcm[j*2] == (int16_t)((expected[j]-128)<<8) && pcm[j*2+1] == pcm[j*2];
+        if(!ok)
+        {
+            fprintf(stderr, "adpcm%d %s stream %d: table decoder differs (samples %d/%d, ref %d/%d, scale %d/%d)\n",
+                bits, useref ? "ref" : "noref", i/2, count, samples, tref, ref, tstep, (int)scale);
+            ++failed;
+        }
+        ++*checked;
+    }
+    return failed;
+}
+
+//end of DSP block: the guest ISR acknowledges
+static void BENCH_RaiseIRQ()
+{
+    ++BENCH_IRQs;
+    if(SBEMU_GetBits() == 16)
+        SBEMU_DSP_INT16ACK(0x220 + SBEMU_PORT_DSP_16ACK);
+    else
+        SBEMU_DSP_ReadStatus(0x220 + SBEMU_PORT_DSP_RS);
+}
+
+//one card interrupt of 'samples' frames, as MAIN_Interrupt less the card handling
+static void BENCH_Interrupt(int samples)
+{
+    BOOL digital;
+    samples = PIPELINE_Render(&BENCH_Pipe, samples, &digital) * 2; //to stereo
+    PIPELINE_Mix(&BENCH_Pipe, BENCH_Out, 0, samples, digital);
+    BENCH_HashData(BENCH_Out, samples*sizeof(int16_t));
+}
+
+//TSC ticks per second, against the monotonic clock
+static double BENCH_CalibrateTSC()
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t tsc0 = PLTFM_RDTSC();
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+    } while((t1.tv_sec - t0.tv_sec)*1000000000LL + (t1.tv_nsec - t0.tv_nsec) < 100000000LL);
+    uint64_t tsc1 = PLTFM_RDTSC();
+    return (double)(tsc1 - tsc0) * 1e9 / (double)((t1.tv_sec - t0.tv_sec)*1000000000LL + (t1.tv_nsec - t0.tv_nsec));
+}
+
+static void BENCH_PrintRate(uint64_t cycles, uint64_t frames, double tschz)
+{
+    if(cycles)
+        printf(" %8.2f", (double)frames * tschz / (double)cycles / 1e6);
+    else
+        printf(" %8s", "-");
+}
+
+static void BENCH_Usage()
+{
+    printf("Usage: sbbench [-n ints] [-q quality] [-x] [-g]\n");
+    printf("  -n  card interrupts of %d frames per case, default %d (golden hashes only checked with the default)\n", BENCH_INT_FRAMES, BENCH_INTS);
+    printf("  -q  resampling quality, 0: linear, 1: windowed-sinc\n");
+    printf("  -x  guest DMA buffer above 1M, through the VDMA map cache\n");
+    printf("  -g  print golden hashes of this run (as golden.h) instead of the report\n");
+}
+
+int main(int argc, char* argv[])
+{
+    int ints = BENCH_INTS;
+    BOOL golden = FALSE;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(strcmp(argv[i], "-n") == 0 && i+1 < argc)
+        {
+            ints = atoi(argv[++i]);
+            ints = max(1, ints);
+        }
+        else if(strcmp(argv[i], "-q") == 0 && i+1 < argc)
+            BENCH_Quality = atoi(argv[++i]) ? 1 : 0;
+        else if(strcmp(argv[i], "-x") == 0)
+            BENCH_DMAAddr = BENCH_DMA_HIGH;
+        else if(strcmp(argv[i], "-g") == 0)
+            golden = TRUE;
+        else
+        {
+            BENCH_Usage();
+            return 1;
+        }
+    }
+
+    BENCH_SbemuExtFun.DMA_Size = &VDMA_GetCounter;
+    BENCH_SbemuExtFun.DMA_Write = &VDMA_WriteData;
+    SBEMU_Init(BENCH_IRQ, BENCH_DMA, BENCH_HDMA, BENCH_DSPVER, &BENCH_SbemuExtFun);
+
+    BENCH_Pipe.CardRate = BENCH_CARD_RATE;
+    BENCH_Pipe.CardSamplesPerInt = BENCH_INT_FRAMES;
+    BENCH_Pipe.HighDMA = TRUE;
+    BENCH_Pipe.NearLinear = TRUE;
+    BENCH_Pipe.RaiseIRQ = &BENCH_RaiseIRQ;
+    BENCH_Pipe.Cycles = BENCH_Cycles;
+    BENCH_Pipe.PCM = BENCH_PCM;
+    BENCH_Pipe.OPLPCM = BENCH_OPLPCM;
+    BENCH_Pipe.PCM_Frames = BENCH_PCM_FRAMES;
+    BENCH_Pipe.DMABUF = (uint8_t*)DPMI_L2PTR(BENCH_DMABUF_ADDR);
+    BENCH_Pipe.SBPCM = BENCH_SBPCM;
+    BENCH_Pipe.SBPCM_Frames = BENCH_SBPCM_FRAMES;
+    memcpy(BENCH_Pipe.GainMix, BENCH_GainMix, sizeof(BENCH_GainMix));
+    memcpy(BENCH_Pipe.GainVoice, BENCH_GainVoice, sizeof(BENCH_GainVoice));
+    memcpy(BENCH_Pipe.GainMidi, BENCH_GainMidi, sizeof(BENCH_GainMidi));
+    memcpy(BENCH_Pipe.GainMaster, BENCH_GainMaster, sizeof(BENCH_GainMaster));
+
+    double tschz = BENCH_CalibrateTSC();
+    uint32_t hashes[BENCH_CASES];
+    int failed = 0, checked = 0;
+    int adpcmchecked = 0;
+    int adpcmfailed = BENCH_CheckADPCM(&adpcmchecked);
+    if(!golden)
+    {
+        printf("card %d Hz, %d frames x %d interrupts per case, resampler quality %d, guest DMA at %06x, TSC %.0f MHz\n",
+            BENCH_CARD_RATE, BENCH_INT_FRAMES, ints, BENCH_Quality, BENCH_DMAAddr, tschz/1e6);
+        printf("%-7s %5s %-4s | %-44s | %-44s | hash\n", "format", "rate", "opl", "cycles/frame", "Mframes/s");
+        printf("%-7s %5s %-4s |", "", "", "");
+        for(int s = 0; s < PIPELINE_STAGES; ++s)
+            printf(" %8s", BENCH_StageNames[s]);
+        printf(" %8s |", "total");
+        for(int s = 0; s < PIPELINE_STAGES; ++s)
+            printf(" %8s", BENCH_StageNames[s]);
+        printf(" %8s |\n", "total");
+    }
+
+    for(int f = 0; f < BENCH_FORMAT_COUNT; ++f)
+    for(int r = 0; r < BENCH_RATE_COUNT; ++r)
+    for(int o = 0; o < BENCH_OPL_COUNT; ++o)
+    {
+        const BENCH_FORMAT* fmt = &BENCH_Formats[f];
+        int index = (f*BENCH_RATE_COUNT + r)*BENCH_OPL_COUNT + o;
+        BOOL opl = o != BENCH_OPL_OFF;
+
+        memset(BENCH_Cycles, 0, sizeof(BENCH_Cycles));
+        BENCH_Hash = 2166136261u;
+        BENCH_IRQs = 0;
+        BENCH_Pipe.OPL = opl;
+        BENCH_Pipe.SBPCM_Count = 0;
+        BENCH_Pipe.ResampleFunc = &mixer_speed_stream;
+        mixer_speed_stream_init(&BENCH_Pipe.Resampler, 2, 0, BENCH_CARD_RATE);
+        mixer_speed_stream_setsinc(&BENCH_Pipe.Resampler, BENCH_Quality);
+        if(opl)
+            BENCH_StartOPL(o);
+        BENCH_StartDSP(fmt, BENCH_Rates[r]);
+
+        for(int i = 0; i < ints; ++i)
+            BENCH_Interrupt(BENCH_INT_FRAMES);
+        BENCH_HashData(&BENCH_IRQs, sizeof(BENCH_IRQs));
+        hashes[index] = BENCH_Hash;
+
+        if(!(CPU_FLAGS()&CPU_IFLAG))
+        {
+            fprintf(stderr, "%s %d %s: interrupts left disabled\n", fmt->name, BENCH_Rates[r], BENCH_OPLNames[o]);
+            return 2;
+        }
+        if(golden)
+            continue;
+
+        uint64_t frames = (uint64_t)BENCH_INT_FRAMES * ints;
+        uint64_t total = 0;
+        printf("%-7s %5d %-4s |", fmt->name, BENCH_Rates[r], BENCH_OPLNames[o]);
+        for(int s = 0; s < PIPELINE_STAGES; ++s)
+        {
+            printf(" %8.1f", (double)BENCH_Cycles[s] / (double)frames);
+            total += BENCH_Cycles[s];
+        }
+        printf(" %8.1f |", (double)total / (double)frames);
+        for(int s = 0; s < PIPELINE_STAGES; ++s)
+            BENCH_PrintRate(BENCH_Cycles[s], frames, tschz);
+        BENCH_PrintRate(total, frames, tschz);
+        printf(" | %08x", hashes[index]);
+        if(ints == BENCH_INTS && BENCH_Golden[BENCH_Quality][index] != 0)
+        {
+            BOOL ok = hashes[index] == BENCH_Golden[BENCH_Quality][index];
+            failed += !ok;
+            ++checked;
+            printf(ok ? " ok" : " FAIL (%08x)", BENCH_Golden[BENCH_Quality][index]);
+        }
+        printf("\n");
+    }
+
+    if(golden)
+    {
+        printf("//golden output hashes of sbbench, per resampler quality and case (format, rate, OPL load).\n");
+        printf("//generated by 'output/host/sbbench -g' and 'output/host/sbbench -g -q 1'. 0: not recorded.\n");
+        printf("static const uint32_t BENCH_Golden[2][BENCH_CASES] =\n{\n");
+        for(int q = 0; q < 2; ++q)
+        {
+            printf("    {");
+            for(int i = 0; i < BENCH_CASES; ++i)
+                printf("%s0x%08x,", (i%8) ? " " : "\n        ", q == BENCH_Quality ? hashes[i] : BENCH_Golden[q][i]);
+            printf("\n    },\n");
+        }
+        printf("};\n");
+        return adpcmfailed ? 1 : 0;
+    }
+    if(checked == 0)
+        printf("golden hashes not checked.\n");
+    else
+        printf("%d cases checked, %d failed.\n", checked, failed);
+    printf("%d ADPCM streams checked against reference decoders, %d failed.\n", adpcmchecked, adpcmfailed);
+    return (failed || adpcmfailed) ? 1 : 0;
+}
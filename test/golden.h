@@ -0,0 +1,45 @@
+//golden output hashes of sbbench, per resampler quality and case (format, rate, OPL load).
+//generated by 'output/host/sbbench -g' and 'output/host/sbbench -g -q 1'. 0: not recorded.
+static const uint32_t BENCH_Golden[2][BENCH_CASES] =
+{
+    {
+        0x097e9acc, 0x097e9acc, 0x5dd6daf4, 0x03954d87, 0xec60b7bd, 0xec60b7bd, 0xc3db8c59, 0x09998781,
+        0x636ea1c5, 0x636ea1c5, 0xd72d10f9, 0xe64b2d7d, 0x280e34f5, 0x280e34f5, 0xd973564d, 0x57acbc3e,
+        0x98b351ab, 0x98b351ab, 0x5a4b0b93, 0x8ebe11cc, 0x2de2e76c, 0x2de2e76c, 0xace14542, 0x991a0854,
+        0x58a2a125, 0x58a2a125, 0xb8994132, 0xbb388e9b, 0x41d25335, 0x41d25335, 0xfe15a2b5, 0x48abe6b4,
+        0xd2be7655, 0xd2be7655, 0xcddc7e23, 0x9e4fe8db, 0x10296b41, 0x10296b41, 0xc4df0232, 0xee72bc4b,
+        0x3e16c58e, 0x3e16c58e, 0x089818be, 0xfc2c7694, 0xe5f0a9f5, 0xe5f0a9f5, 0x8c2e1c69, 0xfd4d58d7,
+        0x07683f95, 0x07683f95, 0xf22e7719, 0x590b5f23, 0x8cafbc55, 0x8cafbc55, 0xeaad55fd, 0x51c7273f,
+        0xbd8ccf10, 0xbd8ccf10, 0xc203e9ac, 0x2fbb2190, 0x54bb325e, 0x54bb325e, 0x578c63d1, 0x7b640f4e,
+        0xbbda4255, 0xbbda4255, 0x704f226e, 0xb1d01cd6, 0x6f342cb5, 0x6f342cb5, 0x7a0ad472, 0xd6e2b640,
+        0x6d443695, 0x6d443695, 0x20c32303, 0x270f48ec, 0x25dc7fa5, 0x25dc7fa5, 0x1f3e470c, 0x9debf3da,
+        0x0ccb101f, 0x0ccb101f, 0xa09a3d77, 0x2dce5032, 0x8515c6a1, 0x8515c6a1, 0x91ac3a2d, 0x4d097c90,
+        0xeca0ec7d, 0xeca0ec7d, 0x5fda93b1, 0xe77d6d1a, 0x479ec5e5, 0x479ec5e5, 0xb9232121, 0x12bbdb74,
+        0x4cf3502c, 0x4cf3502c, 0x723df660, 0xa3e2d7a0, 0x9a487b94, 0x9a487b94, 0xd8c9b098, 0x7a1bffdf,
+        0x3070f03f, 0x3070f03f, 0xd132685f, 0xbf20e50c, 0x81cc8a98, 0x81cc8a98, 0x4b8a3ff8, 0x16d6cdb5,
+        0xe2a50067, 0xe2a50067, 0xca476f77, 0x36f15e7b, 0x8f2a87fe, 0x8f2a87fe, 0x9497da9e, 0xa23ed449,
+        0xe4739a70, 0xe4739a70, 0xd3dc1624, 0x2def4ffa, 0x366864ff, 0x366864ff, 0xa2248183, 0x87bfb0b3,
+        0x600d9e79, 0x600d9e79, 0x116633ad, 0x1daa6099, 0xf917c595, 0xf917c595, 0x09492d0d, 0x9b2f2165,
+        0x11a6c735, 0x11a6c735, 0x0a4a1a51, 0x882684f6,
+    },
+    {
+        0xe4bbe268, 0xe4bbe268, 0x33c8ad30, 0x6e97d184, 0xb0784125, 0xb0784125, 0x4ccc28fd, 0x9ef4f68e,
+        0xc9521c21, 0xc9521c21, 0xa21e1f8d, 0x3f2a78c1, 0x280e34f5, 0x280e34f5, 0xd973564d, 0x57acbc3e,
+        0xe3572f8b, 0xe3572f8b, 0xc2786a03, 0x6490d407, 0x94da9002, 0x94da9002, 0xd7206be3, 0x7cdfdab3,
+        0x3ab165f4, 0x3ab165f4, 0x597c329b, 0xcccf88e0, 0xd6d375ef, 0xd6d375ef, 0xdc6a0b26, 0x464e272b,
+        0xd2be7655, 0xd2be7655, 0xcddc7e23, 0x9e4fe8db, 0xc3ba5bc1, 0xc3ba5bc1, 0xce6c6cfa, 0xdbe3d353,
+        0xf1981ad2, 0xf1981ad2, 0xbe86f6ea, 0xa2bc612c, 0xed98fec9, 0xed98fec9, 0x3941cd85, 0x789dc8b0,
+        0x52d47c7d, 0x52d47c7d, 0x465a8e09, 0xa4eca714, 0x8cafbc55, 0x8cafbc55, 0xeaad55fd, 0x51c7273f,
+        0xacb21140, 0xacb21140, 0xb2c3d504, 0xf15a1c05, 0xaa4ece02, 0xaa4ece02, 0xc1eb24f4, 0xea97eb79,
+        0x9da53a12, 0x9da53a12, 0xa88cfb13, 0x593b1c85, 0x55493af0, 0x55493af0, 0x67b2479e, 0xf461a051,
+        0x6d443695, 0x6d443695, 0x20c32303, 0x270f48ec, 0x7ad6f507, 0x7ad6f507, 0xa48bc1a0, 0xc7da472a,
+        0xd3207027, 0xd3207027, 0xface9e43, 0x60c579c5, 0xd86f046d, 0xd86f046d, 0x9d4088b5, 0x4c1a487e,
+        0x1dda8239, 0x1dda8239, 0xf038d2d5, 0x1a801ce1, 0x479ec5e5, 0x479ec5e5, 0xb9232121, 0x12bbdb74,
+        0xf8fdbb2c, 0xf8fdbb2c, 0x14683518, 0x765cefc9, 0xf4b1a210, 0xf4b1a210, 0x82302260, 0x8278e973,
+        0x3e19f85b, 0x3e19f85b, 0x57df62a3, 0x34ec0c3d, 0x788bb2b4, 0x788bb2b4, 0x36375a08, 0xa63e16e3,
+        0xe2a50067, 0xe2a50067, 0xca476f77, 0x36f15e7b, 0xdfcfd536, 0xdfcfd536, 0xf28d09de, 0x84d4f092,
+        0xe7c47670, 0xe7c47670, 0x4c93c5a4, 0xa80c4486, 0x95c06c87, 0x95c06c87, 0x761991b7, 0x0ce88890,
+        0x79f39c7d, 0x79f39c7d, 0x599f3f21, 0xead207a9, 0xf917c595, 0xf917c595, 0x09492d0d, 0x9b2f2165,
+        0xf85ef629, 0xf85ef629, 0xad9ca841, 0xd9b43876,
+    },
+};
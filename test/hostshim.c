@@ -0,0 +1,113 @@
+//thin DOS/DPMI/port shims to run SBEMU's audio pipeline on a Linux host (see Makefile.host).
+//guest physical memory is a plain host array: linear addresses are offsets into it (1:1, like conventional memory under DPMI),
+//so 32bit linear addresses keep working on 64bit hosts.
+#include <stdio.h>
+#include <string.h>
+#include <fenv.h>
+#include <x86intrin.h>
+#include <platform.h>
+#include <dpmi/dpmi.h>
+#include <untrapio.h>
+#include "hostshim.h"
+
+uint8_t HOST_Memory[HOST_MEMORY_SIZE];
+int HOST_MapCount;
+
+static uint16_t HOST_Flags = CPU_IFLAG;
+
+void CLI()
+{
+    HOST_Flags &= ~CPU_IFLAG;
+}
+
+void STI()
+{
+    HOST_Flags |= CPU_IFLAG;
+}
+
+uint16_t PLTFM_CPU_FLAGS(void)
+{
+    return HOST_Flags;
+}
+
+uint32_t PLTFM_BSF(uint32_t x)
+{
+    return x ? (uint32_t)__builtin_ctz(x) : 0;
+}
+
+uint64_t PLTFM_RDTSC(void)
+{
+    return __rdtsc();
+}
+
+int PLTFM_CPUID(uint32_t leaf, uint32_t regs[4])
+{
+    unused(leaf); unused(regs);
+    return 0; //no CPU features: plain C paths, as in hashes of golden.h
+}
+
+void* DPMI_L2PTR(uint32_t addr)
+{
+    if(addr >= HOST_MEMORY_SIZE)
+    {
+        fprintf(stderr, "host shim: linear address %08x out of guest memory\n", addr);
+        abort();
+    }
+    return HOST_Memory + addr;
+}
+
+//only guest memory has a linear address on the host
+uint32_t DPMI_PTR2L(void* ptr)
+{
+    if((uint8_t*)ptr < HOST_Memory || (uint8_t*)ptr >= HOST_Memory + HOST_MEMORY_SIZE)
+    {
+        fprintf(stderr, "host shim: %p is not in guest memory\n", ptr);
+        abort();
+    }
+    return (uint32_t)((uint8_t*)ptr - HOST_Memory);
+}
+
+void DPMI_CopyLinear(uint32_t dest, uint32_t src, uint32_t size)
+{
+    memcpy(DPMI_L2PTR(dest), DPMI_L2PTR(src), size);
+}
+
+uint32_t DPMI_MapMemory(uint32_t physicaladdr, uint32_t size)
+{
+    if(physicaladdr == 0 || physicaladdr + size > HOST_MEMORY_SIZE)
+        return 0;
+    ++HOST_MapCount;
+    return physicaladdr;
+}
+
+BOOL DPMI_UnmappMemory(uint32_t mappedaddr)
+{
+    --HOST_MapCount;
+    return TRUE;
+}
+
+//no real ISA hardware behind virtualized ports
+void UntrappedIO_OUT(uint16_t port, uint8_t value)
+{
+}
+
+uint8_t UntrappedIO_IN(uint16_t port)
+{
+    return 0xFF;
+}
+
+//mpxplay newfunc
+void pds_fpu_setround_near(void)
+{
+    fesetround(FE_TONEAREST);
+}
+
+void pds_fpu_setround_chop(void)
+{
+    fesetround(FE_TOWARDZERO);
+}
+
+void pds_memcpy(void* dest, const void* src, unsigned int len)
+{
+    memcpy(dest, src, len);
+}
@@ -0,0 +1,19 @@
+#ifndef _HOSTSHIM_H_
+#define _HOSTSHIM_H_
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define HOST_MEMORY_SIZE (16*1024*1024) //ISA DMA range
+
+extern uint8_t HOST_Memory[HOST_MEMORY_SIZE]; //guest physical memory
+extern int HOST_MapCount; //outstanding DPMI_MapMemory mappings
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif//_HOSTSHIM_H_